@@ -0,0 +1,82 @@
+#!/bin/sh
+# Generates synthetic workloads and replays keystroke scripts against them
+# with `dedit --bench`. Usage: bench/run.sh [path/to/dedit]
+
+DEDIT=${1:-./dedit}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/dedit-bench.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# huge: 2M log lines; page through, edit near the top and in the middle, save.
+awk 'BEGIN { for (i = 0; i < 2000000; i++) printf "%08d INFO worker-%d request handled in %d ms\n", i, i % 64, i % 997 }' > "$DIR/huge.txt"
+awk 'BEGIN {
+    printf "i"; for (i = 0; i < 200; i++) printf "%c", 97 + i % 26; printf "\r\033"
+    for (i = 0; i < 300; i++) printf "\033[6~"
+    printf "o"; for (i = 0; i < 50; i++) printf "line %d\r", i; printf "\033"
+    for (i = 0; i < 300; i++) printf "\033[5~"
+    printf "i"; for (i = 0; i < 100; i++) printf "\177"; printf "\033"
+    printf ":w\r:q\r"
+}' > "$DIR/huge.keys"
+
+# long: a 200 KB line and a 100 KB line full of tabs; type and delete in the middle.
+awk 'BEGIN {
+    for (i = 0; i < 20000; i++) printf "{\"k%d\":%d},", i, i; printf "\n"
+    for (i = 0; i < 10000; i++) printf "\tcol%d", i; printf "\n"
+}' > "$DIR/long.txt"
+awk 'BEGIN {
+    for (i = 0; i < 2000; i++) printf "l"
+    printf "i"; for (i = 0; i < 500; i++) printf "%c", 97 + i % 26
+    for (i = 0; i < 300; i++) printf "\177"; printf "\033"
+    printf "j"; for (i = 0; i < 1000; i++) printf "l"
+    printf "a"; for (i = 0; i < 300; i++) printf "%s", (i % 10 == 0) ? "\t" : "x"
+    for (i = 0; i < 100; i++) printf "\177"; printf "\033"
+    printf ":w\r:q\r"
+}' > "$DIR/long.keys"
+
+# tabs: 200k tab-indented lines; scroll, type, split and join lines.
+awk 'BEGIN { for (i = 0; i < 200000; i++) printf "\t\tif (x%d) {\t\t/* %d */\n", i, i }' > "$DIR/tabs.txt"
+awk 'BEGIN {
+    for (i = 0; i < 100; i++) printf "\033[6~"
+    printf "i"; for (i = 0; i < 200; i++) printf "%s", (i % 8 == 0) ? "\t" : "y"
+    for (i = 0; i < 100; i++) printf "\r\tz"
+    for (i = 0; i < 300; i++) printf "\177"; printf "\033"
+    printf ":w\r:q\r"
+}' > "$DIR/tabs.keys"
+
+# paste: one bracketed paste of 20k lines into a small file.
+printf 'hello\nworld\n' > "$DIR/paste.txt"
+awk 'BEGIN {
+    printf "i\033[200~"; for (i = 0; i < 20000; i++) printf "pasted line %d\twith a tab\r", i; printf "\033[201~\033"
+    printf ":w\r:q\r"
+}' > "$DIR/paste.keys"
+
+# bulk: 1M log lines; substitute on every line, then delete one line in 64.
+awk 'BEGIN { for (i = 0; i < 1000000; i++) printf "%08d INFO worker-%d request handled in %d ms\n", i, i % 64, i % 997 }' > "$DIR/bulk.txt"
+printf ':%%s/INFO/WARN/g\r:g/worker-7 /d\r:w\r:q\r' > "$DIR/bulk.keys"
+
+# wrap: 500k lines of mixed length under soft wrap; page both ways, jump, type a long run,
+# then jump past the middle and page back across the split the jump made.
+awk 'BEGIN { for (i = 0; i < 500000; i++) { printf "%d\t", i; for (j = 0; j < i % 240; j++) printf "w"; printf "\n" } }' > "$DIR/wrap.txt"
+awk 'BEGIN {
+    printf ":set wrap\r"
+    for (i = 0; i < 200; i++) printf "\033[6~"
+    printf "G"; for (i = 0; i < 200; i++) printf "\033[5~"
+    printf "250000Gi"; for (i = 0; i < 300; i++) printf "%c", 97 + i % 26; printf "\033"
+    printf "400000G"; for (i = 0; i < 300; i++) printf "\033[5~"
+    printf ":w\r:q\r"
+}' > "$DIR/wrap.keys"
+
+# stream: 1M log lines piped in; page and search while they arrive, then follow the end.
+cp "$DIR/bulk.txt" "$DIR/stream.txt"
+awk 'BEGIN {
+    for (i = 0; i < 50; i++) printf "\033[6~"
+    printf "/worker-9 \r"; for (i = 0; i < 50; i++) printf "n"
+    printf ":follow\r"; for (i = 0; i < 50; i++) printf "k"
+    printf ":q\r"
+}' > "$DIR/stream.keys"
+
+for w in huge long tabs paste bulk wrap; do
+    echo "== $w"
+    "$DEDIT" --bench "$DIR/$w.keys" "$DIR/$w.txt" || exit 1
+done
+echo "== stream"
+"$DEDIT" --bench "$DIR/stream.keys" - < "$DIR/stream.txt" || exit 1
@@ -2,6 +2,9 @@
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h>
@@ -12,13 +15,69 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #define CtrlKey(k) (k & 31)
 #define TAB_STOP 4
+#define COL_STEP 64
 #define MSG_TIME 5
 
 #define ABUF_INIT {NULL, 0}
 
+#define LEAF_ROWS 64
+#define NODE_KIDS 32
+#define LEAF_SPAN 2
+#define SPAN_LINES (1 << 16)
+#define SPAN_BYTES (64 << 20)
+#define WINDOW_ROWS 8192
+
+#define PACK_HASH 12
+#define PACK_LINES (LEAF_ROWS * 64)
+
+#define SCAN_CHUNK (8 << 20)
+#define SCAN_THREADS 16
+
+#define IOV_BATCH 1024
+#define SAVE_SCRATCH (1 << 20)
+
+#define SLAB_SIZE (64 << 10)
+#define SLAB_MIN 16
+#define SLAB_CLASSES 9
+
+#define GAP_MIN 16
+
+#define INBUF_SIZE 4096
+#define INPUT_WAIT 100
+#define PASTE_WAIT 10
+
+#define STREAM_CHUNK (64 << 10)
+#define STREAM_BUDGET (1 << 20)
+
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+
+#define STAT_BUCKETS 24
+
+#define UNDO_BUDGET 16
+
+#define JOURNAL_MAGIC "DEDJRNL1"
+#define JOURNAL_FLUSH (64 << 10)
+#define JOURNAL_SYNC 1
+
+#define BUFFER_BUDGET 64
+
+#define HL_NUMBERS (1 << 0)
+#define HL_STRINGS (1 << 1)
+#define ROWCHAR(row, i) ((row)->chars[(i) < (row)->gap ? (i) : (i) + (row)->gaplen])
+
 enum cursorKeys {
     TAB_KEY = 9,
     BACKSPACE = 127,
@@ -30,7 +89,55 @@ enum cursorKeys {
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DEL_KEY
+    DEL_KEY,
+    PASTE_START,
+    PASTE_END
+};
+
+enum benchOps {
+    OP_INSERT = 0,
+    OP_NEWLINE,
+    OP_DELETE,
+    OP_MOVE,
+    OP_PAGE,
+    OP_COMMAND,
+    OP_PASTE,
+    OP_SEARCH,
+    OP_OTHER,
+    OP_COUNT
+};
+
+enum highlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER
+};
+
+enum undoOps {
+    UNDO_STEP = 0,
+    UNDO_INSERT,
+    UNDO_DELETE,
+    UNDO_ADDROW,
+    UNDO_DELROW
+};
+
+enum savePieces {
+    PIECE_RAW = 0,
+    PIECE_LINE,
+    PIECE_PACK
+};
+
+enum saveStages {
+    SAVE_OK = 0,
+    SAVE_OPEN,
+    SAVE_TRUNCATE,
+    SAVE_WRITE,
+    SAVE_SYNC,
+    SAVE_RENAME
 };
 
 enum modes {
@@ -38,13 +145,104 @@ enum modes {
     INSERT
 };
 
+struct abuf {
+    char *b;
+    int len;
+};
+
+/* Where a character boundary in chars lands in render and on screen. */
+struct colmark {
+    int cx;
+    int r;
+    int col;
+};
+
 typedef struct erow {
     int size;
     int rsize;
     char *chars;
     char *render;
+    int cap;
+    int rcap;
+    int gap;
+    int gaplen;
+    int tabs;
+    _Bool rdirty;
+    unsigned sgen;
+    int smatch;
+    _Bool dirty;
+    char *hl;
+    int hlcap;
+    unsigned char hlin;
+    unsigned char hlend;
+    _Bool hlok;
+    _Bool hlfresh;
+    struct colmark *marks;
+    int nmarks;
+    int markcap;
+    int vlines;
+    unsigned vgen;
+    unsigned wgen;
+    off_t off;
 } erow ;
 
+/* One leaf's lines joined by newlines and compressed with packBlock. */
+struct chunk {
+    char *data;
+    int len;
+    int size;
+    int lines;
+};
+
+/* A leaf is either up to LEAF_ROWS rows, or (leaf == LEAF_SPAN) a single
+ * entry standing for `count` consecutive lines of the mapping that have
+ * never been split into rows: off is where they start and size spans to
+ * the end of the last one. A packed span holds lines of leaves that have
+ * gone cold instead, compressed one leaf per chunk in pack; size is their
+ * length once unpacked. */
+/* With soft wrap on, vcount caches the screen lines of the subtree; it
+ * is only valid while vgen matches E.wrapgen, and any change beneath a
+ * node clears its vgen. seen is the E.trimgen a leaf was last made,
+ * expanded or shown in; only leaves older than that get packed. */
+typedef struct lnode {
+    int leaf;
+    int n;
+    int count;
+    int vcount;
+    unsigned vgen;
+    unsigned seen;
+    struct chunk *pack;
+    int npack;
+    union {
+        erow row[LEAF_ROWS];
+        struct lnode *kid[NODE_KIDS];
+    } u;
+} lnode;
+
+struct syntax {
+    char *filetype;
+    char **filematch;
+    char **keywords;
+    char *slcomment;
+    char *mlstart;
+    char *mlend;
+    int flags;
+};
+
+struct slab {
+    struct slab *next;
+    char data[];
+};
+
+struct arena {
+    struct slab *slabs;
+    char *next[SLAB_CLASSES];
+    char *end[SLAB_CLASSES];
+    void *freelist[SLAB_CLASSES];
+    long allocs;
+    long large;
+};
+
 struct config {
     int mode;
     int cx;
@@ -52,30 +250,70 @@ struct config {
     int rx;
     int rowoff;
     int coloff;
+    int wrapoff;
+    int wrapcy;
+    _Bool wrap;
+    unsigned wrapgen;
+    unsigned trimgen;
     int screenrows;
     int screencols;
     int numrows;
-    erow *row;
+    lnode *rows;
+    lnode *leaf;
+    int leafbase;
+    int expanded;
+    char *map;
+    size_t mapsize;
     char* filename;
     char* tmpFileExt;
+    char* journalExt;
     _Bool mod;
+    long changes;
     char statusmsg[80];
     char* help;
     time_t statusmsg_time;
+    struct abuf *frame;
+    int framerows;
+    int framecols;
+    int framecy;
+    int framecx;
+    _Bool repaint;
+    _Bool msgshown;
+    char inbuf[INBUF_SIZE];
+    int inhead;
+    int incount;
+    int infd;
+    int outfd;
+    int recordfd;
+    int wakefd[2];
+    volatile sig_atomic_t winch;
+    _Bool ineof;
+    int lastkey;
+    int count;
+    int prefix;
+    char *query;
+    int querylen;
+    unsigned searchgen;
+    struct syntax *syntax;
+    int hlvalid;
     struct termios orig_term;
 };
 
-struct abuf {
-    char *b;
-    int len;
-};
-
 void setStatusMsg(const char *fmt, ...); 
-char *commandPrompt(char *);
+char *commandPrompt(char *, void (*callback)(char *, int));
 void disableRawMode();
+void hlInvalidate(int idx);
+int hlRow(struct syntax *syn, const char *s, int len, int state, char *hl);
 void freeEditor();
+int statsDump();
+void spanDrop(lnode *span);
+void rowFlatten(erow *row);
+void gotoLine(int n);
+void clampCursor();
+void wrapReset();
 
 void abAppend(struct abuf *ab, char *s, int len) {
+    if (len <= 0) return;
     char *new = realloc(ab->b, ab->len + len);
 
     if (new == NULL) return;
@@ -88,18 +326,253 @@ void abAppend(struct abuf *ab, char *s, int len) {
 void abFree(struct abuf *ab) {
     free(ab->b);
 }
+struct bench {
+    _Bool on;
+    char *script;
+    double *samples[OP_COUNT];
+    int nsamples[OP_COUNT];
+    int cap[OP_COUNT];
+};
+
+/* Always-on counters for the key -> updateScreen pipeline. Latencies go
+ * into log2 microsecond buckets so recording a frame costs two clock reads. */
+struct stats {
+    long keys;
+    long frames;
+    long lat[STAT_BUCKETS];
+    double latmax;
+    struct timespec keytime;
+    _Bool waiting;
+    double drawtime;
+    double writetime;
+    double opentime;
+    double savetime;
+    long long bytes;
+    long maxbytes;
+    long lines;
+    long rebuilds;
+    long hlscans;
+    long hlpaints;
+    long expands;
+    long collapses;
+    long packs;
+    long unpacks;
+    long packraw;
+    long packbytes;
+    long elided;
+    long long jbytes;
+    long jsyncs;
+    long unloads;
+    char dump[256];
+};
+
+/* One undo log entry; len bytes of text follow it in the log. `back` is
+ * the size of the previous entry so the log can be walked both ways. A
+ * UNDO_STEP entry opens each undoable change and holds the cursor. */
+struct uop {
+    int type;
+    int row;
+    int col;
+    int len;
+    int back;
+};
+
+/* Entries in [0, cur) can be undone, [cur, len) redone. */
+struct undolog {
+    char *log;
+    long len;
+    long cap;
+    long cur;
+    long last;
+    long saved;
+    long budget;
+    _Bool brk;
+    _Bool replay;
+    _Bool skip;
+    int bcx;
+    int bcy;
+};
+
+/* A stretch of a save snapshot: bytes written as they are, a line that
+ * still needs its newline, or a compressed chunk (len bytes unpacking to
+ * size) that is written with one. */
+struct piece {
+    char *p;
+    size_t len;
+    int size;
+    int kind;
+};
+
+/* A buffer text held by a save in flight after its row or span let go. */
+struct held {
+    char *p;
+    int cap;
+};
+
+/* A save in flight. The main thread fills in the snapshot and only looks
+ * at the rest again after `done` is set under the lock. */
+struct savejob {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    _Bool threaded;
+    _Bool busy;
+    _Bool done;
+    unsigned gen;
+    struct piece *pieces;
+    int cnt;
+    int cap;
+    struct held *held;
+    int nheld;
+    int heldcap;
+    struct iovec *iov;
+    off_t len;
+    char *filename;
+    char *tmpname;
+    int rows;
+    long changes;
+    struct timespec start;
+    double secs;
+    int stage;
+    int err;
+    struct stat st;
+};
+
+/* Sidecar journal of the row operations made since the file was last
+ * written, in the undo log's entry format. Entries are appended in
+ * batches when the editor goes idle; each batch is sealed by an
+ * UNDO_STEP holding the cursor and, in `back`, a checksum of the batch. */
+struct journal {
+    _Bool on;
+    _Bool replay;
+    int fd;
+    char *name;
+    char *buf;
+    long len;
+    long cap;
+    long last;
+    off_t end;
+    off_t mark;
+    struct timespec synced;
+};
+
+struct jhead {
+    char magic[8];
+    long long size;
+    long long sec;
+    long long nsec;
+};
+
+/* One open file. E, U and J always describe the current buffer; the
+ * others are parked here with their edited rows resident and the rest
+ * folded back into spans over their mapping. Clean ones can be unloaded
+ * altogether and are reopened from disk when switched back to. */
+struct buffer {
+    int cx;
+    int cy;
+    int rowoff;
+    int coloff;
+    int wrapoff;
+    int numrows;
+    lnode *rows;
+    char *map;
+    size_t mapsize;
+    char *filename;
+    _Bool mod;
+    long changes;
+    struct syntax *syntax;
+    int hlvalid;
+    struct undolog undo;
+    struct journal journal;
+    _Bool loaded;
+    long used;
+    long tick;
+};
+
+/* Parked buffers are kept under budget bytes of heap, least recently
+ * used ones going first. */
+struct buflist {
+    struct buffer *buf;
+    int n;
+    int cap;
+    int cur;
+    long tick;
+    long budget;
+};
+
+/* Input arriving on a pipe (dedit -, or stdin not a terminal). It is
+ * read while idle and appended as rows to the buffer it was opened in,
+ * and only while that buffer is the current one. A line without its
+ * newline yet is held back in part. */
+struct stream {
+    int fd;
+    int buf;
+    char *part;
+    int len;
+    int cap;
+    long bytes;
+    _Bool follow;
+};
+
+/* The packed span read last, unpacked, so walking its lines again is free,
+ * and the scratch leafPack gathers and compresses a leaf in. */
+struct unpacked {
+    lnode *span;
+    char *buf;
+    int cap;
+    char *raw;
+    char *out;
+    int rawcap;
+    int outcap;
+};
+
 struct config E;
+struct undolog U;
+struct savejob W = {.lock = PTHREAD_MUTEX_INITIALIZER};
+struct journal J = {.fd = -1};
+struct buflist L;
+struct arena A;
+struct bench B;
+struct stats S;
+struct stream P = {.fd = -1, .buf = -1};
+struct unpacked K;
+
+char *cExtensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *cKeywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "goto", "do", "sizeof", "const", "extern", "volatile", "inline", "register",
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "auto|", "bool|", "_Bool|", "size_t|", "off_t|", NULL
+};
+
+struct syntax syntaxes[] = {
+    {"c", cExtensions, cKeywords, "//", "/*", "*/", HL_NUMBERS | HL_STRINGS},
+};
+
+void benchReport();
+void streamRead();
+int streamHere();
+int saveCheck();
+void saveWait();
+void updateScreen();
+void journalPut(int type, int row, int col, const char *s, int len);
+void journalFlush();
 
 void die(const char *s) {
-    write(STDOUT_FILENO, "\x1b[2J" , 4);
-    write(STDOUT_FILENO, "\x1b[H" , 3);
+    write(E.outfd, "\x1b[2J" , 4);
+    write(E.outfd, "\x1b[H" , 3);
+    int err = errno;
+    statsDump();
     freeEditor();
     disableRawMode();
+    errno = err;
     perror(s);
     exit(1);
 }
 
 void disableRawMode() {
+    if (B.on) return;
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_term) == -1) die("tcsetattr");
 }
 
@@ -113,56 +586,10 @@ void enableRawMode() {
     raw.c_iflag &= ~(IXON | ICRNL);
     raw.c_oflag &= ~(OPOST);
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
-}
-
-int readKeypress() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1){
-        if (nread == -1) die("read");
-    }
-
-    if (c == '\x1b') {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
-            }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
-            }
-        }
-    }
-    return c;
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 int getWindowSize(int *rows, int *cols){
@@ -177,363 +604,4327 @@ int getWindowSize(int *rows, int *cols){
     }
 }
 
-void updateRow(erow *row) {
-    int tabs = 0;
-    for (int i = 0; i < row->size; ++i) {
-        if (row->chars[i] == '\t') tabs++;
-    }
-    free(row->render);
-    row->render = (char*) malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+/* The SIGWINCH handler and the save thread wake the event loop through
+ * a pipe that poll watches next to the input. */
+void handleWinch(int sig) {
+    (void) sig;
+    int saved = errno;
+    E.winch = 1;
+    write(E.wakefd[1], "w", 1);
+    errno = saved;
+}
 
-    int idx = 0;
-    for (int i = 0; i < row->size; ++i) {
-        if (row->chars[i] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
-        } else { 
-            row->render[idx++] = row->chars[i];
+void wakeInit() {
+    if (pipe2(E.wakefd, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe");
+    if (B.on) return;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleWinch;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+/* Sleeps until input arrives or timeout ms pass, -1 meaning no limit.
+ * With wake set, a write to the wake pipe ends the wait as well. */
+int inputWait(int timeout, int wake) {
+    int nfds = wake && streamHere() ? 3 : 2;
+    struct pollfd pfd[3] = {{E.infd, POLLIN, 0}, {E.wakefd[0], POLLIN, 0}, {P.fd, POLLIN, 0}};
+    while (1) {
+        int n = poll(pfd, nfds, timeout);
+        if (n == -1 && errno != EINTR) die("poll");
+        if (n == 0) return 0;
+        if (n > 0 && (pfd[1].revents & POLLIN)) {
+            char buf[64];
+            while (read(E.wakefd[0], buf, sizeof(buf)) > 0);
         }
+        if (n > 0 && nfds == 3 && pfd[2].revents) streamRead();
+        if (n > 0 && pfd[0].revents) return 1;
+        if (wake) return 0;
     }
-
-    row->render[idx] = '\0';
-    row->rsize = idx;
 }
 
-void insertRow(int idx, char *s, size_t len) {
-    if (idx < 0 || idx > E.numrows) return;
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[idx + 1], &E.row[idx], sizeof(erow) * (E.numrows - idx));
-    E.row[idx].size = len;
-    E.row[idx].chars = (char*) malloc(len + 1);
-    memcpy(E.row[idx].chars, s, len);
-    E.row[idx].chars[len] = '\0';
-    E.row[idx].rsize = 0;
-    E.row[idx].render = NULL;
-    updateRow(&E.row[idx]);
-    E.numrows++;
+/* Input is read in blocks into a ring buffer, only after poll says some
+ * is there, so an empty read means the other end is gone. */
+int inputRead() {
+    int tail = (E.inhead + E.incount) % INBUF_SIZE;
+    int space = (tail >= E.inhead) ? INBUF_SIZE - tail : E.inhead - tail;
+    if (E.incount == INBUF_SIZE) return 0;
 
-    E.mod = 1;
+    int nread = read(E.infd, &E.inbuf[tail], space);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread == 0) E.ineof = 1;
+    if (nread <= 0) return 0;
+    if (E.recordfd != -1) write(E.recordfd, &E.inbuf[tail], nread);
+    E.incount += nread;
+    return nread;
 }
 
-int cxToRx(erow *row, int cx) {
-    int rx = 0;
-    for (int i = 0; i < cx; ++i) {
-        if (row->chars[i] == '\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-        rx++;
+/* Waits at most timeout ms, so a failed fill in the middle of an escape
+ * sequence or a paste means the terminal has nothing more queued. */
+int inputFill(int timeout) {
+    if (E.incount == INBUF_SIZE || E.ineof || !inputWait(timeout, 0)) return 0;
+    return inputRead();
+}
+
+int inputPeek(int i, char *c) {
+    while (E.incount <= i) {
+        if (!inputFill(INPUT_WAIT)) return 0;
     }
-    return rx;
+    *c = E.inbuf[(E.inhead + i) % INBUF_SIZE];
+    return 1;
 }
 
-void rowInsertChar(erow *row, int idx, int c) {
-    if (idx < 0 || idx > row->size) idx = row->size;
+void inputSkip(int n) {
+    E.inhead = (E.inhead + n) % INBUF_SIZE;
+    E.incount -= n;
+}
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[idx + 1], &row->chars[idx], row->size - idx + 1);
-    row->chars[idx] = c;
-    row->size++;
-    updateRow(row);
+int inputPending() {
+    if (E.incount > 0) return 1;
+    inputFill(0);
+    return E.incount > 0;
+}
 
-    E.mod = 1;
+int readEscape() {
+    char seq[8];
+
+    if (!inputPeek(0, &seq[0]) || !inputPeek(1, &seq[1])) return '\x1b';
+
+    if (seq[0] == '[') {
+        if (seq[1] >= '0' && seq[1] <= '9') {
+            int n = 1;
+            int num = 0;
+            while (n < (int) sizeof(seq) && inputPeek(n, &seq[n]) && seq[n] >= '0' && seq[n] <= '9') {
+                num = num * 10 + seq[n] - '0';
+                n++;
+            }
+            if (n == (int) sizeof(seq) || !inputPeek(n, &seq[n])) return '\x1b';
+            inputSkip(n + 1);
+            if (seq[n] == '~') {
+                switch (num) {
+                    case 1: return HOME_KEY;
+                    case 3: return DEL_KEY;
+                    case 4: return END_KEY;
+                    case 5: return PAGE_UP;
+                    case 6: return PAGE_DOWN;
+                    case 7: return HOME_KEY;
+                    case 8: return END_KEY;
+                    case 200: return PASTE_START;
+                    case 201: return PASTE_END;
+                }
+            }
+        } else {
+            inputSkip(2);
+            switch (seq[1]) {
+                case 'A': return ARROW_UP;
+                case 'B': return ARROW_DOWN;
+                case 'C': return ARROW_RIGHT;
+                case 'D': return ARROW_LEFT;
+                case 'H': return HOME_KEY;
+                case 'F': return END_KEY;
+            }
+        }
+    } else if (seq[0] == 'O') {
+        inputSkip(2);
+        switch (seq[1]) {
+            case 'H': return HOME_KEY;
+            case 'F': return END_KEY;
+        }
+    }
+    return '\x1b';
 }
 
-void rowDelChar(erow *row, int idx) {
-    if (idx < 0 || idx > row->size) return;
-    memmove(&row->chars[idx], &row->chars[idx + 1], row->size - idx);
-    row->size--;
-    updateRow(row);
-    E.mod = 1;
+/* Milliseconds until the status message on screen expires, or -1. */
+int msgTimeout() {
+    if (!E.msgshown) return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long ms = (E.statusmsg_time + MSG_TIME - now.tv_sec) * 1000L - now.tv_nsec / 1000000;
+    return ms > 0 ? ms : 0;
 }
 
-void rowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    updateRow(row);
-    E.mod = 1;
+void windowResize() {
+    int rows, cols;
+    E.winch = 0;
+    if (getWindowSize(&rows, &cols) == -1) return;
+    E.screenrows = rows > 3 ? rows - 2 : 1;
+    if (cols != E.screencols) wrapReset();
+    E.screencols = cols;
+    E.repaint = 1;
+}
+
+/* The event loop. Idle time is spent blocked in poll; it wakes up for
+ * input, a resize, a finished save, a status message running out or
+ * more of a stream. */
+int readKeypress() {
+    char c;
+    while (!E.incount) {
+        if (E.ineof) {
+            journalFlush();
+            if (W.busy) {
+                saveWait();
+                updateScreen();
+            }
+            benchReport();
+            statsDump();
+            exit(0);
+        }
+        journalFlush();
+        if (inputWait(msgTimeout(), 1)) {
+            inputRead();
+            continue;
+        }
+        if (E.winch) windowResize();
+        saveCheck();
+        updateScreen();
+    }
+    inputPeek(0, &c);
+    inputSkip(1);
+
+    if (c == '\x1b') return readEscape();
+    return c;
 }
 
+/* Row text comes from power-of-two size classes carved out of shared slabs,
+ * which also gives every row geometric capacity growth. Blocks too big for
+ * a slab go to malloc. */
+int slabClass(int size, int *cap) {
+    int c = 0;
+    *cap = SLAB_MIN;
+    while (*cap < size) {
+        *cap *= 2;
+        c++;
+    }
+    return c;
+}
 
-void freeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
+char *rowAlloc(int size, int *cap) {
+    int c = slabClass(size, cap);
+    A.allocs++;
+    if (c >= SLAB_CLASSES) {
+        A.large++;
+        char *p = (char*) malloc(*cap);
+        if (p == NULL) die("malloc");
+        return p;
+    }
+    if (A.freelist[c]) {
+        char *p = A.freelist[c];
+        A.freelist[c] = *(void**) p;
+        return p;
+    }
+    if (A.next[c] == A.end[c]) {
+        struct slab *slab = (struct slab*) malloc(sizeof(struct slab) + SLAB_SIZE);
+        if (slab == NULL) die("malloc");
+        slab->next = A.slabs;
+        A.slabs = slab;
+        A.next[c] = slab->data;
+        A.end[c] = slab->data + SLAB_SIZE;
+    }
+    char *p = A.next[c];
+    A.next[c] += *cap;
+    return p;
 }
 
-void delRow(int idx) {
-    if (idx < 0 || idx >= E.numrows) return;
-    freeRow(&E.row[idx]);
-    memmove(&E.row[idx], &E.row[idx + 1], sizeof(erow) * (E.numrows - idx - 1));
-    E.numrows--;
-    E.mod = 1;
+void rowFree(char *p, int cap) {
+    if (p == NULL) return;
+    int c = slabClass(cap, &cap);
+    if (c >= SLAB_CLASSES) {
+        A.large--;
+        free(p);
+        return;
+    }
+    *(void**) p = A.freelist[c];
+    A.freelist[c] = p;
 }
-void delChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        rowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        rowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        delRow(E.cy);
-        E.cy--;
+
+char *rowGrow(char *p, int *cap, int used, int size) {
+    if (p && size <= *cap) return p;
+    int newcap;
+    char *new = rowAlloc(size, &newcap);
+    if (p) {
+        memcpy(new, p, used);
+        rowFree(p, *cap);
     }
+    *cap = newcap;
+    return new;
 }
 
-void insertChar(char c) {
-    if (E.cy == E.numrows) insertRow(E.numrows, "", 0);
-    rowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+void arenaFree() {
+    while (A.slabs) {
+        struct slab *next = A.slabs->next;
+        free(A.slabs);
+        A.slabs = next;
+    }
+    memset(&A, 0, sizeof(A));
 }
 
-void insertNewline() {
-    if (E.cx == 0) {
-        insertRow(E.cy, "", 0);
+/* East Asian Wide and Fullwidth characters, two columns each (Unicode 14,
+ * with unassigned gaps folded into their neighbours). */
+const int wideChars[][2] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x23f0, 0x23f0},
+    {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267f, 0x267f},
+    {0x2693, 0x2693}, {0x26a1, 0x26a1}, {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce}, {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b}, {0x2728, 0x2728},
+    {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27b0, 0x27b0}, {0x27bf, 0x27bf}, {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55},
+    {0x2e80, 0x303e}, {0x3041, 0x3247}, {0x3250, 0x4dbf}, {0x4e00, 0xa4c6}, {0xa960, 0xa97c},
+    {0xac00, 0xd7a3}, {0xf900, 0xfad9}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6b}, {0xff01, 0xff60},
+    {0xffe0, 0xffe6}, {0x16fe0, 0x1b2fb}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e},
+    {0x1f191, 0x1f19a}, {0x1f200, 0x1f320}, {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393},
+    {0x1f3a0, 0x1f3ca}, {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e},
+    {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567},
+    {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5},
+    {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2}, {0x1f6d5, 0x1f6df}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc},
+    {0x1f7e0, 0x1f7f0}, {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faf6},
+    {0x20000, 0x3fffd}
+};
+
+/* Combining marks and other characters that take no column of their own.
+ * This covers the common scripts rather than every mark in Unicode. */
+const int zeroChars[][2] = {
+    {0x300, 0x36f}, {0x483, 0x489}, {0x591, 0x5bd}, {0x5bf, 0x5bf}, {0x5c1, 0x5c2},
+    {0x5c4, 0x5c5}, {0x5c7, 0x5c7}, {0x610, 0x61a}, {0x64b, 0x65f}, {0x670, 0x670},
+    {0x6d6, 0x6dc}, {0x6df, 0x6e4}, {0x6e7, 0x6e8}, {0x6ea, 0x6ed}, {0x93c, 0x93c},
+    {0x941, 0x948}, {0x94d, 0x94d}, {0xe31, 0xe31}, {0xe34, 0xe3a}, {0xe47, 0xe4e},
+    {0x1160, 0x11ff}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x2060, 0x2064},
+    {0x20d0, 0x20f0}, {0x302a, 0x302d}, {0x3099, 0x309a}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f},
+    {0xfeff, 0xfeff}, {0xe0100, 0xe01ef}
+};
+
+/* Decodes the UTF-8 sequence at s, reading at most n bytes, and returns the
+ * code point with its length in *len. Malformed or truncated input comes
+ * back as -1, one byte at a time. */
+int utf8Decode(const char *s, int n, int *len) {
+    unsigned char c = s[0];
+    *len = 1;
+    if (c < 0x80) return c;
+    int need, cp;
+    if (c >= 0xc2 && c <= 0xdf) {
+        need = 1;
+        cp = c & 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        need = 2;
+        cp = c & 0x0f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        need = 3;
+        cp = c & 0x07;
     } else {
-        erow *row = &E.row[E.cy];
-        insertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        updateRow(row);
+        return -1;
     }
-    E.cy++;
-    E.cx = 0;
+    if (need >= n) return -1;
+    for (int i = 1; i <= need; ++i) {
+        if ((s[i] & 0xc0) != 0x80) return -1;
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+    if ((need == 2 && cp < 0x800) || (need == 3 && cp < 0x10000)) return -1;
+    if (cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) return -1;
+    *len = need + 1;
+    return cp;
 }
 
-char *rowsToString(int *len) {
-    int tmplen = 0;
-    for (int i  = 0; i < E.numrows; ++i) {
-        tmplen += E.row[i].size + 1;
+int rangeFind(const int (*table)[2], int n, int cp) {
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < table[mid][0]) {
+            hi = mid - 1;
+        } else if (cp > table[mid][1]) {
+            lo = mid + 1;
+        } else {
+            return 1;
+        }
     }
-    *len = tmplen;
-    char *s = (char*) malloc(tmplen);
-    char *p = s;
-    for (int i = 0; i < E.numrows; ++i) {
-        memcpy(p, E.row[i].chars, E.row[i].size);
-        p += E.row[i].size;
-        *p = '\n';
-        p++;
+    return 0;
+}
+
+/* Screen columns taken by a code point; malformed bytes take one each. */
+int charCols(int cp) {
+    if (cp < 0x300) return 1;
+    if (rangeFind(zeroChars, sizeof(zeroChars) / sizeof(zeroChars[0]), cp)) return 0;
+    if (rangeFind(wideChars, sizeof(wideChars) / sizeof(wideChars[0]), cp)) return 2;
+    return 1;
+}
+
+/* Decodes the character at byte i of a row, reading across the gap. */
+int rowChar(erow *row, int i, int *len) {
+    char c = ROWCHAR(row, i);
+    if ((unsigned char) c < 0x80) {
+        *len = 1;
+        return c;
     }
+    char buf[4];
+    int n = row->size - i < 4 ? row->size - i : 4;
+    for (int k = 0; k < n; ++k) buf[k] = ROWCHAR(row, i + k);
+    return utf8Decode(buf, n, len);
+}
 
-    return s;
+/* Soft wrap breaks a line before the first character that doesn't fit
+ * on what is left of the screen line; a tab counts as the single spaces
+ * it expands to. */
+void wrapReset() {
+    if (++E.wrapgen == 0) E.wrapgen = 1;
 }
-void fileSave() {
-    if (E.filename == NULL) {
-        E.filename = commandPrompt("Save as: %s [ESC to Cancel]");
-        if (E.filename == NULL) {
-            setStatusMsg("Save Aborted");
-            return;
+
+int lineLines(const char *p, int len) {
+    int cols = E.screencols;
+    if (len <= cols && memchr(p, '\t', len) == NULL) return 1;
+    int i = 0;
+    for (unsigned long long w; i + 8 <= len; i += 8) {
+        memcpy(&w, &p[i], 8);
+        if (w & 0x8080808080808080ULL) break;
+    }
+    while (i < len && (unsigned char) p[i] < 0x80) i++;
+    if (i == len) {
+        int width = 0;
+        const char *q = p, *end = p + len, *tab;
+        while ((tab = memchr(q, '\t', end - q)) != NULL) {
+            width += tab - q;
+            width += TAB_STOP - width % TAB_STOP;
+            q = tab + 1;
         }
+        width += end - q;
+        return width ? (width + cols - 1) / cols : 1;
     }
-    int len;
-    char *buf = rowsToString(&len);
-    int filenameLen = strlen(E.filename);
-    int tmpExtLen = strlen(E.tmpFileExt);
-    int tmpFilenameLen = filenameLen + tmpExtLen + 1;
-    char* tmpfilename = (char*) malloc(tmpFilenameLen);
-    memcpy(tmpfilename, E.filename, filenameLen);
-    memcpy(&tmpfilename[filenameLen], E.tmpFileExt, tmpExtLen);
-    tmpfilename[tmpFilenameLen] = '\0';
-
-    int fd = open(tmpfilename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) { 
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                if (rename(tmpfilename, E.filename) != -1){
-                    free(tmpfilename);
-                    setStatusMsg("\"%s\" %dL, %dB written", E.filename, E.numrows, len);
-                    E.mod = 0;
-                    return;
-                } else {
-                    setStatusMsg("Couldn't overwrite \"%s\": %s", E.filename, strerror(errno));
-                }
-            } else {
-                setStatusMsg("Failed to write changes to temp file: %s", strerror(errno));
+    int lines = 1, scol = 0, acol = 0, n;
+    for (int i = 0; i < len; i += n) {
+        int k = 1, cw = 1;
+        n = 1;
+        if (p[i] == '\t') {
+            k = TAB_STOP - acol % TAB_STOP;
+        } else if ((unsigned char) p[i] >= 0x80) {
+            cw = charCols(utf8Decode(&p[i], len - i, &n));
+        }
+        int w = cw > cols ? cols : cw;
+        for (; k > 0; --k) {
+            if (scol + w > cols) {
+                lines++;
+                scol = 0;
             }
-        } else {
-            setStatusMsg("ftruncate failed: %s", strerror(errno));
+            scol += w;
+            acol += cw;
         }
-        close(fd);
     }
-    free(buf);
-    free(tmpfilename);
+    return lines;
 }
 
-void fileOpen(char* filename) {
-    /* free(E.filename); */
-    E.filename = strdup(filename);
-
-    FILE *fp = NULL;
+/* End of the screen line of render starting at r, and its width. */
+int wrapNext(const char *s, int len, int r, int *width) {
+    int scol = 0, n;
+    while (r < len) {
+        int w = charCols(utf8Decode(&s[r], len - r, &n));
+        if (w > E.screencols) w = E.screencols;
+        if (scol + w > E.screencols) break;
+        scol += w;
+        r += n;
+    }
+    if (width) *width = scol;
+    return r;
+}
 
-    if (access(E.filename, 'r') == F_OK) {
-        fp = fopen(E.filename, "r");
+/* Without tabs the render would be a byte for byte copy of chars, so it
+ * just points at chars, gap and all; rcap then holds minus the bytes that
+ * saved. Readers that need it contiguous go through renderFlat. */
+void renderAlias(erow *row) {
+    if (row->rcap > 0) {
+        rowFree(row->render, row->rcap);
     } else {
-        int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-        close(fd);
-        fp = fopen(E.filename, "r");
+        S.elided += row->rcap;
     }
-    if (!fp) die("fopen");
+    row->render = row->chars;
+    row->rcap = -(row->size + 1);
+    S.elided -= row->rcap;
+    row->rsize = row->size;
+    row->tabs = 0;
+    row->rdirty = 0;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1){
-        if (linelen != -1) {
-            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
-            insertRow(E.numrows, line, linelen);
+void updateRow(erow *row) {
+    S.rebuilds++;
+    int tabs = 0;
+    for (int i = 0; i < row->size; ++i) {
+        if (ROWCHAR(row, i) == '\t') tabs++;
+    }
+    if (tabs == 0 && row->chars) {
+        renderAlias(row);
+        row->hlfresh = 0;
+        return;
+    }
+    if (row->rcap < 0) {
+        S.elided += row->rcap;
+        row->render = NULL;
+        row->rcap = 0;
+    }
+    row->render = rowGrow(row->render, &row->rcap, 0, row->size + tabs*(TAB_STOP - 1) + 1);
+
+    int idx = 0, col = 0;
+    for (int i = 0; i < row->size;) {
+        int len;
+        char ch = ROWCHAR(row, i);
+        if (ch == '\t') {
+            do {
+                row->render[idx++] = ' ';
+            } while (++col % TAB_STOP != 0);
+            i++;
+            continue;
         }
+        if ((unsigned char) ch < 0x80) {
+            row->render[idx++] = ch;
+            col++;
+            i++;
+        } else {
+            int c = rowChar(row, i, &len);
+            for (int k = 0; k < len; ++k) row->render[idx++] = ROWCHAR(row, i + k);
+            col += charCols(c);
+            i += len;
+        }
+    }
+
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    row->tabs = tabs;
+    row->rdirty = 0;
+    row->hlfresh = 0;
+}
+
+/* While a row has no tabs an edit only has to keep the render pointed at
+ * chars, which leaves the text where the gap buffer put it. Anything else
+ * defers to updateRow at draw time. */
+void renderInsert(erow *row, char *s, size_t len) {
+    int tabs = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (s[i] == '\t') tabs++;
+    }
+    if (row->rdirty || row->tabs || tabs) {
+        row->tabs += tabs;
+        row->rdirty = 1;
+        return;
+    }
+    renderAlias(row);
+}
+
+void renderDelete(erow *row, int c) {
+    if (c == '\t') row->tabs--;
+    if (row->rdirty || row->tabs || c == '\t') {
+        row->rdirty = 1;
+        return;
+    }
+    renderAlias(row);
+}
+
+/* Brings the render up to date and closes the gap a shared render has. */
+void renderFlat(erow *row) {
+    if (row->rdirty) updateRow(row);
+    if (row->rcap < 0 && row->gaplen) {
+        rowFlatten(row);
+        row->render = row->chars;
+    }
+}
+
+/* Decodes the character at render offset r, across the gap of a render
+ * shared with chars, whose offsets are the same. */
+int renderChar(erow *row, int r, int *len) {
+    if (row->rcap < 0) return rowChar(row, r, len);
+    return utf8Decode(&row->render[r], row->rsize - r, len);
+}
+
+lnode *nodeNew(int leaf) {
+    lnode *node = (lnode*) malloc(sizeof(lnode));
+    if (node == NULL) die("malloc");
+    node->leaf = leaf;
+    node->n = 0;
+    node->count = 0;
+    node->vcount = 0;
+    node->vgen = 0;
+    node->seen = E.trimgen;
+    node->pack = NULL;
+    node->npack = 0;
+    return node;
+}
+
+void nodeCount(lnode *node) {
+    node->vgen = 0;
+    if (node->leaf) {
+        if (node->leaf != LEAF_SPAN) node->count = node->n;
+        return;
+    }
+    node->count = 0;
+    for (int i = 0; i < node->n; ++i) node->count += node->u.kid[i]->count;
+}
+
+lnode *nodeSplit(lnode *node, int at) {
+    lnode *right = nodeNew(node->leaf);
+    right->n = node->n - at;
+    if (node->leaf) {
+        memcpy(right->u.row, &node->u.row[at], sizeof(erow) * right->n);
+    } else {
+        memcpy(right->u.kid, &node->u.kid[at], sizeof(lnode*) * right->n);
+    }
+    node->n = at;
+    return right;
+}
+
+void nodeMerge(lnode *a, lnode *b) {
+    if (a->leaf) {
+        memcpy(&a->u.row[a->n], b->u.row, sizeof(erow) * b->n);
+    } else {
+        memcpy(&a->u.kid[a->n], b->u.kid, sizeof(lnode*) * b->n);
+    }
+    a->n += b->n;
+    a->count += b->count;
+    a->vgen = 0;
+    free(b);
+}
+
+void leafInsert(lnode *node, int idx, erow *row) {
+    memmove(&node->u.row[idx + 1], &node->u.row[idx], sizeof(erow) * (node->n - idx));
+    node->u.row[idx] = *row;
+    node->n++;
+}
+
+void kidInsert(lnode *node, int idx, lnode *kid) {
+    memmove(&node->u.kid[idx + 1], &node->u.kid[idx], sizeof(lnode*) * (node->n - idx));
+    node->u.kid[idx] = kid;
+    node->n++;
+}
+
+void kidRemove(lnode *node, int idx) {
+    memmove(&node->u.kid[idx], &node->u.kid[idx + 1], sizeof(lnode*) * (node->n - idx - 1));
+    node->n--;
+}
+
+/* Inserts kid at position idx, splitting a full node; returns the split. */
+lnode *kidAdd(lnode *node, int idx, lnode *kid) {
+    lnode *right = NULL;
+    if (node->n == NODE_KIDS) {
+        right = nodeSplit(node, idx == node->n ? node->n : node->n / 2);
+        if (idx > node->n || node->n == NODE_KIDS) {
+            kidInsert(right, idx - node->n, kid);
+        } else {
+            kidInsert(node, idx, kid);
+        }
+    } else {
+        kidInsert(node, idx, kid);
+    }
+    return right;
+}
+
+/* Returns the new right sibling when the node had to split. Appends split
+ * off just the new entry so that sequential loads leave full nodes behind. */
+lnode *nodeInsert(lnode *node, int idx, erow *row) {
+    lnode *right = NULL;
+    if (node->leaf) {
+        if (node->n == LEAF_ROWS) {
+            right = nodeSplit(node, idx == node->n ? node->n : node->n / 2);
+            if (idx > node->n || node->n == LEAF_ROWS) {
+                leafInsert(right, idx - node->n, row);
+            } else {
+                leafInsert(node, idx, row);
+            }
+        } else {
+            leafInsert(node, idx, row);
+        }
+    } else {
+        int i = 0;
+        while (i < node->n - 1 && idx > node->u.kid[i]->count) {
+            idx -= node->u.kid[i]->count;
+            i++;
+        }
+        lnode *split = nodeInsert(node->u.kid[i], idx, row);
+        if (split) right = kidAdd(node, i + 1, split);
+    }
+    nodeCount(node);
+    if (right) nodeCount(right);
+    return right;
+}
+
+void nodeDelete(lnode *node, int idx) {
+    node->count--;
+    node->vgen = 0;
+    if (node->leaf) {
+        memmove(&node->u.row[idx], &node->u.row[idx + 1], sizeof(erow) * (node->n - idx - 1));
+        node->n--;
+        return;
+    }
+    int i = 0;
+    while (idx >= node->u.kid[i]->count) {
+        idx -= node->u.kid[i]->count;
+        i++;
+    }
+    lnode *kid = node->u.kid[i];
+    nodeDelete(kid, idx);
+
+    int cap = kid->leaf ? LEAF_ROWS : NODE_KIDS;
+    if (kid->n == 0) {
+        free(kid);
+        kidRemove(node, i);
+    } else if (kid->n <= cap / 4) {
+        if (i + 1 < node->n && node->u.kid[i + 1]->leaf != LEAF_SPAN && kid->n + node->u.kid[i + 1]->n <= cap) {
+            nodeMerge(kid, node->u.kid[i + 1]);
+            kidRemove(node, i + 1);
+        } else if (i > 0 && node->u.kid[i - 1]->leaf != LEAF_SPAN && node->u.kid[i - 1]->n + kid->n <= cap) {
+            nodeMerge(node->u.kid[i - 1], kid);
+            kidRemove(node, i);
+        }
+    }
+}
+
+void nodeFree(lnode *node) {
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; ++i) nodeFree(node->u.kid[i]);
+    }
+    spanDrop(node);
+    free(node);
+}
+
+void treeRoot(lnode *split) {
+    lnode *root = nodeNew(0);
+    root->u.kid[0] = E.rows;
+    root->n = 1;
+    if (split) root->u.kid[root->n++] = split;
+    nodeCount(root);
+    E.rows = root;
+}
+
+void treeInsert(int idx, erow *row) {
+    lnode *split = nodeInsert(E.rows, idx, row);
+    if (split) treeRoot(split);
+    E.leaf = NULL;
+    E.numrows++;
+}
+
+/* Adds count to every node on the path to row idx. */
+void nodeAdjust(lnode *node, int idx, int count) {
+    while (1) {
+        node->count += count;
+        node->vgen = 0;
+        if (node->leaf) return;
+        int i = 0;
+        while (idx >= node->u.kid[i]->count) {
+            idx -= node->u.kid[i]->count;
+            i++;
+        }
+        node = node->u.kid[i];
+    }
+}
+
+/* Links a whole leaf in so that its first line becomes row idx, which
+ * must fall on a leaf boundary. */
+lnode *nodeAddLeaf(lnode *node, int idx, lnode *leaf) {
+    int i = 0;
+    lnode *right = NULL;
+    if (node->u.kid[0]->leaf) {
+        while (i < node->n && idx > 0) {
+            idx -= node->u.kid[i]->count;
+            i++;
+        }
+        right = kidAdd(node, i, leaf);
+    } else {
+        while (i < node->n - 1 && idx > node->u.kid[i]->count) {
+            idx -= node->u.kid[i]->count;
+            i++;
+        }
+        lnode *split = nodeAddLeaf(node->u.kid[i], idx, leaf);
+        if (split) right = kidAdd(node, i + 1, split);
+    }
+    nodeCount(node);
+    if (right) nodeCount(right);
+    return right;
+}
+
+void treeAddLeaf(int idx, lnode *leaf) {
+    if (E.rows->leaf) treeRoot(NULL);
+    lnode *split = nodeAddLeaf(E.rows, idx, leaf);
+    if (split) treeRoot(split);
+    E.leaf = NULL;
+    E.numrows += leaf->count;
+}
+
+void treeDelete(int idx) {
+    nodeDelete(E.rows, idx);
+    while (!E.rows->leaf && E.rows->n == 1) {
+        lnode *root = E.rows->u.kid[0];
+        free(E.rows);
+        E.rows = root;
+    }
+    E.leaf = NULL;
+    E.numrows--;
+}
+
+void rowInit(erow *row, off_t off, int size) {
+    row->size = size;
+    row->rsize = 0;
+    row->chars = NULL;
+    row->render = NULL;
+    row->cap = 0;
+    row->rcap = 0;
+    row->gap = 0;
+    row->gaplen = 0;
+    row->tabs = 0;
+    row->rdirty = 0;
+    row->sgen = 0;
+    row->dirty = 0;
+    row->hl = NULL;
+    row->hlcap = 0;
+    row->hlin = 0;
+    row->hlend = 0;
+    row->hlok = 0;
+    row->hlfresh = 0;
+    row->marks = NULL;
+    row->nmarks = 0;
+    row->markcap = 0;
+    row->vgen = 0;
+    row->wgen = 0;
+    row->off = off;
+}
+
+lnode *spanNew(off_t off, int size, int lines) {
+    lnode *span = nodeNew(LEAF_SPAN);
+    rowInit(&span->u.row[0], off, size);
+    span->n = 1;
+    span->count = lines;
+    return span;
+}
+
+/* Returns the end of the line starting at p (its newline, or end) and its
+ * length without trailing CRs. */
+char *lineEnd(char *p, char *end, int *len) {
+    char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL) eol = end;
+    char *q = eol;
+    while (q > p && q[-1] == '\r') q--;
+    *len = q - p;
+    return eol;
+}
+
+/* Cold leaves are packed with an LZ4-style block codec: a token holding
+ * the literal run and match lengths (15 meaning more bytes follow, each
+ * 255 meaning yet more), the literals, then a two byte offset back to
+ * where the match is copied from. The last run is literals only. */
+unsigned packHash(const char *p, int bits) {
+    unsigned v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+int packBound(int n) {
+    return n + n / 255 + 16;
+}
+
+char *packLength(char *op, int len) {
+    for (; len >= 255; len -= 255) *op++ = (char) 255;
+    *op++ = len;
+    return op;
+}
+
+char *packRun(char *op, const char *lit, int litlen, int mlen) {
+    *op++ = (litlen < 15 ? litlen : 15) << 4 | (mlen < 15 ? mlen : 15);
+    if (litlen >= 15) op = packLength(op, litlen - 15);
+    memcpy(op, lit, litlen);
+    return op + litlen;
+}
+
+/* Compresses n bytes of src into dst, which has room for packBound(n),
+ * and returns the compressed length. Small inputs use less of the table
+ * so clearing it doesn't cost more than the input does. */
+int packBlock(const char *src, int n, char *dst) {
+    int table[1 << PACK_HASH], bits = PACK_HASH;
+    while (bits > 8 && 1 << bits > n / 2) bits--;
+    memset(table, -1, sizeof(int) << bits);
+    const char *ip = src, *anchor = src, *end = src + n;
+    const char *mflimit = n > 12 ? end - 12 : src, *mlimit = end - 5;
+    char *op = dst;
+    while (ip < mflimit) {
+        unsigned h = packHash(ip, bits);
+        int ref = table[h];
+        table[h] = ip - src;
+        if (ref < 0 || ip - src - ref > 65535 || memcmp(src + ref, ip, 4) != 0) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        const char *m = src + ref;
+        const char *q = ip + 4;
+        while (q + 8 <= mlimit && memcmp(q, m + (q - ip), 8) == 0) q += 8;
+        while (q < mlimit && *q == m[q - ip]) q++;
+        while (ip > anchor && m > src && ip[-1] == m[-1]) {
+            ip--;
+            m--;
+        }
+        int off = ip - m, mlen = q - ip - 4;
+        op = packRun(op, anchor, ip - anchor, mlen);
+        *op++ = off & 255;
+        *op++ = off >> 8;
+        if (mlen >= 15) op = packLength(op, mlen - 15);
+        table[packHash(q - 2, bits)] = q - 2 - src;
+        ip = anchor = q;
+    }
+    op = packRun(op, anchor, end - anchor, 0);
+    return op - dst;
+}
+
+/* Undoes packBlock; returns the number of bytes written to dst. */
+int unpackBlock(const char *src, int n, char *dst) {
+    const unsigned char *ip = (const unsigned char*) src, *end = ip + n;
+    char *op = dst;
+    while (ip < end) {
+        int token = *ip++;
+        int len = token >> 4;
+        if (len == 15) {
+            do len += *ip; while (*ip++ == 255);
+        }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip >= end) break;
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+        len = token & 15;
+        if (len == 15) {
+            do len += *ip; while (*ip++ == 255);
+        }
+        len += 4;
+        const char *m = op - off;
+        if (off >= len) {
+            memcpy(op, m, len);
+            op += len;
+        } else {
+            while (len--) *op++ = *m++;
+        }
+    }
+    return op - dst;
+}
+
+char *packGrow(char **buf, int *cap, int size) {
+    if (*cap < size) {
+        *cap = size;
+        free(*buf);
+        *buf = malloc(*cap);
+        if (*buf == NULL) die("malloc");
+    }
+    return *buf;
+}
+
+/* Unpacks a packed span into *buf, growing it as needed. Safe to call
+ * from worker threads as long as each brings its own buffer. */
+char *packText(lnode *span, char **buf, int *cap) {
+    int size = span->u.row[0].size;
+    char *p = packGrow(buf, cap, size + 1);
+    for (int i = 0; i < span->npack; ++i) {
+        struct chunk *c = &span->pack[i];
+        if (unpackBlock(c->data, c->len, p) != c->size) die("unpack");
+        p += c->size;
+        *p++ = '\n';
+    }
+    (*buf)[size] = '\0';
+    return *buf;
+}
+
+/* The bytes behind a span: the mapping, or for a packed one its lines
+ * unpacked into K, which holds one span at a time. */
+char *spanText(lnode *span) {
+    if (span->pack == NULL) return E.map + span->u.row[0].off;
+    if (K.span != span) {
+        K.span = NULL;
+        packText(span, &K.buf, &K.cap);
+        K.span = span;
+    }
+    return K.buf;
+}
+
+/* Text a save in flight may still be writing is freed once it is done;
+ * cap is the slab size, or -1 for malloc'd chunk data. */
+void saveHold(char *p, int cap) {
+    if (W.nheld == W.heldcap) {
+        W.heldcap = W.heldcap ? W.heldcap * 2 : 64;
+        W.held = realloc(W.held, sizeof(struct held) * W.heldcap);
+        if (W.held == NULL) die("realloc");
+    }
+    W.held[W.nheld++] = (struct held) {p, cap};
+}
+
+void chunkFree(char *data) {
+    if (W.busy) {
+        saveHold(data, -1);
+    } else {
+        free(data);
+    }
+}
+
+/* Frees a packed span's chunks. */
+void spanDrop(lnode *span) {
+    if (span->pack == NULL) return;
+    if (K.span == span) K.span = NULL;
+    for (int i = 0; i < span->npack; ++i) {
+        S.packraw -= span->pack[i].size;
+        S.packbytes -= span->pack[i].len;
+        chunkFree(span->pack[i].data);
+    }
+    free(span->pack);
+    span->pack = NULL;
+    span->npack = 0;
+}
+
+/* A packed span over n chunks, which it copies. */
+lnode *packNew(struct chunk *c, int n) {
+    lnode *span = nodeNew(LEAF_SPAN);
+    span->pack = malloc(sizeof(struct chunk) * n);
+    if (span->pack == NULL) die("malloc");
+    memcpy(span->pack, c, sizeof(struct chunk) * n);
+    span->npack = n;
+    int size = -1;
+    for (int i = 0; i < n; ++i) {
+        size += c[i].size + 1;
+        span->count += c[i].lines;
+    }
+    rowInit(&span->u.row[0], 0, size);
+    span->u.row[0].dirty = 1;
+    span->n = 1;
+    return span;
+}
+
+/* Finds the leaf holding row idx without expanding spans. */
+lnode *leafAt(int idx) {
+    if (E.leaf && idx >= E.leafbase && idx < E.leafbase + E.leaf->count) return E.leaf;
+    lnode *node = E.rows;
+    int base = idx;
+    while (!node->leaf) {
+        int i = 0;
+        while (idx >= node->u.kid[i]->count) {
+            idx -= node->u.kid[i]->count;
+            i++;
+        }
+        node = node->u.kid[i];
+    }
+    E.leaf = node;
+    E.leafbase = base - idx;
+    return node;
+}
+
+/* Turns the chunk holding row idx back into the leaf of loaded rows it
+ * was packed from, in the span's node, and links the chunks on either
+ * side in as packed spans of their own. */
+void spanUnpack(lnode *span, int base, int idx) {
+    struct chunk *chunks = span->pack;
+    int n = span->npack, k = 0, before = 0;
+    while (k < n - 1 && idx - base >= before + chunks[k].lines) before += chunks[k++].lines;
+    struct chunk c = chunks[k];
+    if (K.span == span) K.span = NULL;
+    char *p = packGrow(&K.buf, &K.cap, c.size + 1);
+    if (unpackBlock(c.data, c.len, p) != c.size) die("unpack");
+    char *end = p + c.size;
+    int len, lines = span->count;
+
+    nodeAdjust(E.rows, base, c.lines - lines);
+    E.numrows -= lines - c.lines;
+    span->leaf = 1;
+    span->n = 0;
+    span->pack = NULL;
+    span->npack = 0;
+    for (int i = 0; i < c.lines; ++i) {
+        char *eol = lineEnd(p, end, &len);
+        erow *row = &span->u.row[span->n++];
+        rowInit(row, 0, len);
+        row->chars = rowAlloc(len + 1, &row->cap);
+        memcpy(row->chars, p, len);
+        row->chars[len] = '\0';
+        row->dirty = 1;
+        updateRow(row);
+        p = eol + 1;
+    }
+    S.packraw -= c.size;
+    S.packbytes -= c.len;
+    chunkFree(c.data);
+    if (k > 0) treeAddLeaf(base, packNew(chunks, k));
+    if (k + 1 < n) treeAddLeaf(base + before + c.lines, packNew(chunks + k + 1, n - k - 1));
+    free(chunks);
+    span->seen = E.trimgen;
+    E.leaf = NULL;
+    E.expanded += c.lines;
+    S.unpacks++;
+    hlInvalidate(base);
+}
+
+/* Splits the LEAF_ROWS lines around row idx out of a span into unloaded
+ * rows. The span's node becomes the leaf holding them and the lines on
+ * either side are linked in as new spans, so no existing erow moves. */
+void spanExpand(lnode *span, int base, int idx) {
+    if (span->pack) {
+        spanUnpack(span, base, idx);
+        return;
+    }
+    erow whole = span->u.row[0];
+    int lines = span->count;
+    int before = (idx - base) / LEAF_ROWS * LEAF_ROWS;
+    int rows = lines - before < LEAF_ROWS ? lines - before : LEAF_ROWS;
+    char *start = E.map + whole.off;
+    char *end = start + whole.size;
+    char *p = start;
+    int len;
+    /* Screen line counts carry over to the pieces: the shorter side is
+     * counted and the other one is what is left of the span's total. */
+    _Bool wrapped = E.wrap && span->vgen == E.wrapgen;
+    _Bool front = before <= lines - before - rows;
+    int vleft = span->vcount, vbefore = 0;
+    /* So do highlight states once the span has been scanned: the front
+     * piece and the new rows are lexed on the walk to them, and the back
+     * piece keeps the span's end state, so nothing after it goes stale. */
+    _Bool lexed = E.syntax && whole.hlok && E.hlvalid > base;
+    int state = whole.hlin;
+    for (int k = 0; k < before; ++k) {
+        char *eol = lineEnd(p, end, &len);
+        if (wrapped && front) vbefore += lineLines(p, len);
+        if (lexed) state = hlRow(E.syntax, p, len, state, NULL);
+        p = eol + 1;
+    }
+    char *mid = p;
+    int midstate = state;
+
+    nodeAdjust(E.rows, base, rows - lines);
+    E.numrows -= lines - rows;
+    span->leaf = 1;
+    span->n = 0;
+    for (int k = 0; k < rows; ++k) {
+        char *eol = lineEnd(p, end, &len);
+        erow *row = &span->u.row[span->n++];
+        rowInit(row, p - E.map, len);
+        if (wrapped) {
+            row->vlines = lineLines(p, len);
+            row->vgen = E.wrapgen;
+            vleft -= row->vlines;
+        }
+        if (lexed) {
+            row->hlin = state;
+            state = hlRow(E.syntax, p, len, state, NULL);
+            row->hlend = state;
+            row->hlok = 1;
+        }
+        p = eol + 1;
+    }
+    if (wrapped && !front) {
+        int vafter = 0;
+        char *q = p;
+        for (int k = before + rows; k < lines; ++k) {
+            char *eol = lineEnd(q, end, &len);
+            vafter += lineLines(q, len);
+            q = eol + 1;
+        }
+        vbefore = vleft - vafter;
+    }
+    if (before) {
+        char *q = mid - 1;
+        while (q > start && q[-1] == '\r') q--;
+        lnode *leaf = spanNew(whole.off, q - start, before);
+        if (wrapped) {
+            leaf->vcount = vbefore;
+            leaf->vgen = E.wrapgen;
+        }
+        if (lexed) {
+            leaf->u.row[0].hlin = whole.hlin;
+            leaf->u.row[0].hlend = midstate;
+            leaf->u.row[0].hlok = 1;
+        }
+        treeAddLeaf(base, leaf);
+    }
+    if (before + rows < lines) {
+        lnode *leaf = spanNew(p - E.map, end - p, lines - before - rows);
+        if (wrapped) {
+            leaf->vcount = vleft - vbefore;
+            leaf->vgen = E.wrapgen;
+        }
+        if (lexed) {
+            leaf->u.row[0].hlin = state;
+            leaf->u.row[0].hlend = whole.hlend;
+            leaf->u.row[0].hlok = 1;
+        }
+        treeAddLeaf(base + before + rows, leaf);
+    }
+    span->seen = E.trimgen;
+    E.leaf = NULL;
+    E.expanded += rows;
+    S.expands++;
+    if (!lexed) hlInvalidate(base);
+}
+
+erow *rowSlot(int idx) {
+    lnode *leaf = leafAt(idx);
+    if (leaf->leaf == LEAF_SPAN) {
+        spanExpand(leaf, E.leafbase, idx);
+        leaf = leafAt(idx);
+    }
+    return &leaf->u.row[idx - E.leafbase];
+}
+
+/* Like rowSlot, but a row inside a span is answered by the span itself. */
+erow *rowPeek(int idx) {
+    lnode *leaf = leafAt(idx);
+    return leaf->leaf == LEAF_SPAN ? &leaf->u.row[0] : &leaf->u.row[idx - E.leafbase];
+}
+
+void loadRow(erow *row) {
+    row->chars = rowAlloc(row->size + 1, &row->cap);
+    memcpy(row->chars, E.map + row->off, row->size);
+    row->chars[row->size] = '\0';
+    row->gap = 0;
+    row->gaplen = 0;
+    updateRow(row);
+}
+
+erow *rowAt(int idx) {
+    erow *row = rowSlot(idx);
+    if (row->chars == NULL) loadRow(row);
+    return row;
+}
+
+/* A save snapshot points at the text of resident rows instead of copying
+ * it, so the first edit or free of such a row after :w leaves the old
+ * buffer to the save and carries on in a copy. */
+int rowShared(erow *row) {
+    return W.busy && row->chars && row->wgen == W.gen;
+}
+
+void rowRelease(erow *row) {
+    if (rowShared(row)) {
+        saveHold(row->chars, row->cap);
+    } else {
+        rowFree(row->chars, row->cap);
+    }
+}
+
+void rowOwn(erow *row) {
+    if (!rowShared(row)) return;
+    int cap, len = row->size + row->gaplen + 1;
+    char *chars = rowAlloc(len, &cap);
+    memcpy(chars, row->chars, len);
+    saveHold(row->chars, row->cap);
+    row->chars = chars;
+    row->cap = cap;
+    row->wgen = 0;
+    if (row->rcap < 0) row->render = chars;
+}
+
+/* Rows being typed into keep a gap at the last edit position; the
+ * characters are [0, gap) followed by [gap + gaplen, size + gaplen). */
+void rowGapTo(erow *row, int idx) {
+    if (row->gaplen == 0) {
+        row->gap = idx;
+        return;
+    }
+    if (idx < row->gap) {
+        memmove(&row->chars[idx + row->gaplen], &row->chars[idx], row->gap - idx);
+    } else {
+        memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], idx - row->gap);
+    }
+    row->gap = idx;
+}
+
+void rowGapOpen(erow *row, int need) {
+    if (row->gaplen >= need) return;
+    rowGapTo(row, row->size);
+    row->chars = rowGrow(row->chars, &row->cap, row->size + 1, row->size + need + GAP_MIN);
+    row->gaplen = row->cap - row->size - 1;
+    row->chars[row->size + row->gaplen] = '\0';
+}
+
+void rowFlatten(erow *row) {
+    if (row->gaplen == 0) return;
+    rowGapTo(row, row->size);
+    row->gaplen = 0;
+    row->chars[row->size] = '\0';
+}
+
+char *rowData(erow *row) {
+    if (row->chars == NULL) return E.map + row->off;
+    rowFlatten(row);
+    return row->chars;
+}
+
+int nodeFind(lnode *node, erow *row, int base) {
+    if (node->leaf) {
+        if (row >= node->u.row && row < node->u.row + node->n) return base + (row - node->u.row);
+        return -1;
+    }
+    for (int i = 0; i < node->n; ++i) {
+        int idx = nodeFind(node->u.kid[i], row, base);
+        if (idx != -1) return idx;
+        base += node->u.kid[i]->count;
+    }
+    return -1;
+}
+
+/* Edits nearly always land on the row rowSlot just returned, so the
+ * cached leaf answers this without walking the tree. */
+int rowIndex(erow *row) {
+    if (E.leaf && row >= E.leaf->u.row && row < E.leaf->u.row + E.leaf->n) {
+        return E.leafbase + (row - E.leaf->u.row);
+    }
+    return nodeFind(E.rows, row, 0);
+}
+
+int isSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+int hlMatch(const char *s, int i, int len, char *pat) {
+    int n = strlen(pat);
+    return n <= len - i && memcmp(&s[i], pat, n) == 0;
+}
+
+void hlFill(char *hl, int at, int n, int cls) {
+    if (hl) memset(&hl[at], cls, n);
+}
+
+/* Highlights len bytes of s starting in lexer state `state` (1 inside a
+ * block comment) and returns the state at the end of the line. With hl ==
+ * NULL only the state is tracked, which is all off-screen rows need. */
+int hlRow(struct syntax *syn, const char *s, int len, int state, char *hl) {
+    int slen = syn->slcomment ? strlen(syn->slcomment) : 0;
+    int mslen = syn->mlstart ? strlen(syn->mlstart) : 0;
+    int melen = syn->mlend ? strlen(syn->mlend) : 0;
+    int prev = HL_NORMAL;
+    int sep = 1;
+    int str = 0;
+    int comment = state;
+
+    hlFill(hl, 0, len, HL_NORMAL);
+    int i = 0;
+    while (i < len) {
+        unsigned char c = s[i];
+        if (slen && !str && !comment && hlMatch(s, i, len, syn->slcomment)) {
+            hlFill(hl, i, len - i, HL_COMMENT);
+            break;
+        }
+        if (mslen && melen && !str) {
+            if (comment) {
+                if (hlMatch(s, i, len, syn->mlend)) {
+                    hlFill(hl, i, melen, HL_MLCOMMENT);
+                    i += melen;
+                    comment = 0;
+                    sep = 1;
+                } else {
+                    hlFill(hl, i++, 1, HL_MLCOMMENT);
+                }
+                prev = HL_MLCOMMENT;
+                continue;
+            } else if (hlMatch(s, i, len, syn->mlstart)) {
+                hlFill(hl, i, mslen, HL_MLCOMMENT);
+                i += mslen;
+                comment = 1;
+                continue;
+            }
+        }
+        if (syn->flags & HL_STRINGS) {
+            if (str) {
+                hlFill(hl, i, 1, HL_STRING);
+                if (c == '\\' && i + 1 < len) {
+                    hlFill(hl, i + 1, 1, HL_STRING);
+                    i += 2;
+                    continue;
+                }
+                if (c == str) str = 0;
+                i++;
+                sep = 1;
+                prev = HL_STRING;
+                continue;
+            } else if (c == '"' || c == '\'') {
+                str = c;
+                hlFill(hl, i++, 1, HL_STRING);
+                prev = HL_STRING;
+                continue;
+            }
+        }
+        if (hl == NULL) {
+            i++;
+            continue;
+        }
+        if ((syn->flags & HL_NUMBERS) && ((isdigit(c) && (sep || prev == HL_NUMBER)) || (c == '.' && prev == HL_NUMBER))) {
+            hl[i++] = HL_NUMBER;
+            sep = 0;
+            prev = HL_NUMBER;
+            continue;
+        }
+        if (sep) {
+            int j;
+            for (j = 0; syn->keywords[j]; ++j) {
+                int klen = strlen(syn->keywords[j]);
+                int kw2 = syn->keywords[j][klen - 1] == '|';
+                if (kw2) klen--;
+                if (klen <= len - i && memcmp(&s[i], syn->keywords[j], klen) == 0 && (i + klen == len || isSeparator((unsigned char) s[i + klen]))) {
+                    hlFill(hl, i, klen, kw2 ? HL_KEYWORD2 : HL_KEYWORD1);
+                    i += klen;
+                    break;
+                }
+            }
+            if (syn->keywords[j]) {
+                sep = 0;
+                prev = HL_KEYWORD1;
+                continue;
+            }
+        }
+        sep = isSeparator(c);
+        prev = HL_NORMAL;
+        i++;
+    }
+    return comment;
+}
+
+int hlColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        default: return 39;
+    }
+}
+
+void selectSyntax() {
+    E.syntax = NULL;
+    E.hlvalid = 0;
+    if (E.filename == NULL) return;
+    char *ext = strrchr(E.filename, '.');
+    for (size_t i = 0; i < sizeof(syntaxes) / sizeof(syntaxes[0]); ++i) {
+        for (char **m = syntaxes[i].filematch; *m; ++m) {
+            if (ext && strcmp(ext, *m) == 0) {
+                E.syntax = &syntaxes[i];
+                return;
+            }
+        }
+    }
+}
+
+/* Rows [0, E.hlvalid) have a known lexer state at both ends. */
+void hlInvalidate(int idx) {
+    if (idx >= 0 && idx < E.hlvalid) E.hlvalid = idx;
+}
+
+/* Brings the end-of-line states up to date through row `upto`. A row is
+ * only rescanned when it was edited or the state flowing into it changed,
+ * so an edit costs one row plus however far a comment opener reaches. */
+void hlSync(int upto) {
+    if (E.syntax == NULL) return;
+    if (upto >= E.numrows) upto = E.numrows - 1;
+    int i = E.hlvalid;
+    if (i > upto) return;
+    if (leafAt(i)->leaf == LEAF_SPAN) i = E.leafbase;
+    int state = i > 0 ? rowPeek(i - 1)->hlend : 0;
+    while (i <= upto) {
+        lnode *leaf = leafAt(i);
+        erow *row = rowPeek(i);
+        if (!row->hlok || row->hlin != state) {
+            if (row->hlin != state) row->hlfresh = 0;
+            row->hlin = state;
+            if (row->chars == NULL) {
+                char *p = leaf->pack ? spanText(leaf) : E.map + row->off;
+                char *end = p + row->size;
+                int len;
+                while (1) {
+                    char *eol = lineEnd(p, end, &len);
+                    state = hlRow(E.syntax, p, len, state, NULL);
+                    if (eol == end) break;
+                    p = eol + 1;
+                }
+                row->hlend = state;
+            } else {
+                renderFlat(row);
+                row->hlend = hlRow(E.syntax, row->render, row->rsize, state, NULL);
+            }
+            row->hlok = 1;
+            S.hlscans++;
+        }
+        state = row->hlend;
+        i += leaf->leaf == LEAF_SPAN ? leaf->count : 1;
+    }
+    E.hlvalid = i;
+}
+
+void rowEdited(erow *row) {
+    row->sgen = 0;
+    row->dirty = 1;
+    row->hlok = 0;
+    row->hlfresh = 0;
+    row->vgen = 0;
+    int idx = rowIndex(row);
+    hlInvalidate(idx);
+    if (E.wrap) nodeAdjust(E.rows, idx, 0);
+    E.mod = 1;
+    E.changes++;
+}
+
+long undoSize(struct uop *op) {
+    return (sizeof(struct uop) + op->len + 3) & ~3L;
+}
+
+struct uop *undoEntry(long off) {
+    return (struct uop*) &U.log[off];
+}
+
+void undoReset() {
+    free(U.log);
+    U.log = NULL;
+    U.len = U.cap = U.cur = 0;
+    U.last = -1;
+    U.saved = 0;
+    U.brk = 1;
+    U.skip = 0;
+}
+
+/* Called before every NORMAL mode key, so a whole insert session undoes
+ * as one change. */
+void undoBreak() {
+    U.brk = 1;
+    U.skip = 0;
+    U.bcx = E.cx;
+    U.bcy = E.cy;
+}
+
+/* Drops whole changes from the front until the log is back under 3/4 of
+ * the budget, so trimming is amortized over many edits. A single change
+ * bigger than the budget clears the history and is not recorded. */
+void undoTrim() {
+    if (U.len <= U.budget) return;
+    long off = 0;
+    long cut = 0;
+    while (off < U.len && U.len - cut > U.budget / 4 * 3) {
+        off += undoSize(undoEntry(off));
+        if (off < U.len && undoEntry(off)->type == UNDO_STEP) cut = off;
+    }
+    if (cut == 0) {
+        undoReset();
+        U.saved = -1;
+        U.skip = 1;
+        setStatusMsg("Change too large to undo, history cleared");
+        return;
+    }
+    memmove(U.log, &U.log[cut], U.len - cut);
+    U.len -= cut;
+    U.cur -= cut;
+    U.last -= cut;
+    U.saved = U.saved >= cut ? U.saved - cut : -1;
+    undoEntry(0)->back = 0;
+}
+
+void undoPush(int type, int row, int col, const char *s, int len) {
+    long back = U.last >= 0 ? U.len - U.last : 0;
+    long need = U.len + sizeof(struct uop) + len + 4;
+    if (need > U.cap) {
+        U.cap = need > U.cap * 2 ? need : U.cap * 2;
+        U.log = realloc(U.log, U.cap);
+        if (U.log == NULL) die("realloc");
+    }
+    struct uop *op = undoEntry(U.len);
+    op->type = type;
+    op->row = row;
+    op->col = col;
+    op->len = len;
+    op->back = back;
+    if (len) memcpy(&op[1], s, len);
+    U.last = U.len;
+    U.len += undoSize(op);
+    U.cur = U.len;
+}
+
+/* Extends the previous entry when this edit continues it: typing
+ * forwards, or deleting with x/Del (same column) or backspace. */
+int undoCoalesce(int type, int row, int col, const char *s, int len) {
+    if (U.last < 0) return 0;
+    struct uop *op = undoEntry(U.last);
+    if (op->type != type || op->row != row) return 0;
+    int front;
+    if (type == UNDO_INSERT && op->col + op->len == col) {
+        front = 0;
+    } else if (type == UNDO_DELETE && op->col == col) {
+        front = 0;
+    } else if (type == UNDO_DELETE && col + len == op->col) {
+        front = 1;
+    } else {
+        return 0;
+    }
+    long need = U.last + sizeof(struct uop) + op->len + len + 4;
+    if (need > U.cap) {
+        U.cap = need > U.cap * 2 ? need : U.cap * 2;
+        U.log = realloc(U.log, U.cap);
+        if (U.log == NULL) die("realloc");
+        op = undoEntry(U.last);
+    }
+    char *text = (char*) &op[1];
+    if (front) {
+        memmove(&text[len], text, op->len);
+        memcpy(text, s, len);
+        op->col = col;
+    } else {
+        memcpy(&text[op->len], s, len);
+    }
+    op->len += len;
+    U.len = U.cur = U.last + undoSize(op);
+    return 1;
+}
+
+void undoRecord(int type, int row, int col, const char *s, int len) {
+    journalPut(type, row, col, s, len);
+    if (U.replay || U.skip || row < 0) return;
+    if (U.cur < U.len) {
+        U.len = U.cur;
+        if (U.saved > U.cur) U.saved = -1;
+    }
+    if (U.brk) {
+        undoPush(UNDO_STEP, U.bcy, U.bcx, NULL, 0);
+        U.brk = 0;
+    } else if (undoCoalesce(type, row, col, s, len)) {
+        return;
+    }
+    undoPush(type, row, col, s, len);
+    undoTrim();
+}
+
+void insertRow(int idx, char *s, size_t len) {
+    if (idx < 0 || idx > E.numrows) return;
+    undoRecord(UNDO_ADDROW, idx, 0, s, len);
+    if (idx > 0) rowSlot(idx - 1);
+    if (idx < E.numrows) rowSlot(idx);
+    erow row;
+    rowInit(&row, 0, len);
+    row.chars = rowAlloc(len + 1, &row.cap);
+    memcpy(row.chars, s, len);
+    row.chars[len] = '\0';
+    row.dirty = 1;
+    updateRow(&row);
+    treeInsert(idx, &row);
+    hlInvalidate(idx);
+
+    E.mod = 1;
+    E.changes++;
+}
+
+/* Steps from boundary m over whole characters up to byte cx of chars, or
+ * the first boundary past it. */
+struct colmark colWalk(erow *row, struct colmark m, int cx) {
+    if (cx > row->size) cx = row->size;
+    while (m.cx < cx) {
+        int len;
+        int c = rowChar(row, m.cx, &len);
+        int w = c == '\t' ? TAB_STOP - m.col % TAB_STOP : charCols(c);
+        m.cx += len;
+        m.r += c == '\t' ? w : len;
+        m.col += w;
+    }
+    return m;
+}
+
+/* Rows of COL_STEP bytes or more keep a checkpoint at the first boundary
+ * at or after every COL_STEP bytes of chars, so mapping a position never
+ * walks more than one step. They are built lazily, and an edit drops the
+ * ones from its offset on. */
+void colExtend(erow *row, int k) {
+    int size = sizeof(struct colmark);
+    if (row->nmarks == 0) {
+        row->marks = (struct colmark*) rowGrow((char*) row->marks, &row->markcap, 0, size);
+        row->marks[0] = (struct colmark) {0, 0, 0};
+        row->nmarks = 1;
+    }
+    while (row->nmarks <= k && row->marks[row->nmarks - 1].cx < row->size) {
+        int n = row->nmarks;
+        row->marks = (struct colmark*) rowGrow((char*) row->marks, &row->markcap, n * size, (n + 1) * size);
+        row->marks[n] = colWalk(row, row->marks[n - 1], n * COL_STEP);
+        row->nmarks++;
+    }
+}
+
+void colsEdited(erow *row, int at) {
+    if (row->nmarks > at / COL_STEP) row->nmarks = at / COL_STEP;
+}
+
+int cxToRx(erow *row, int cx) {
+    struct colmark m = {0, 0, 0};
+    if (row->size >= COL_STEP) {
+        int k = cx / COL_STEP;
+        colExtend(row, k);
+        if (k >= row->nmarks) k = row->nmarks - 1;
+        if (row->marks[k].cx > cx) k--;
+        m = row->marks[k];
+    }
+    return colWalk(row, m, cx).col;
+}
+
+/* Render offset of the first character drawn with the row scrolled to
+ * column col. A wide character cut by the left edge is skipped, and *pad
+ * gets the columns of it that would still show. */
+int colToRender(erow *row, int col, int *pad) {
+    struct colmark m = {0, 0, 0};
+    *pad = 0;
+    if (col == 0) return 0;
+    if (row->size >= COL_STEP) {
+        colExtend(row, 0);
+        while (row->marks[row->nmarks - 1].col <= col && row->marks[row->nmarks - 1].cx < row->size) {
+            colExtend(row, row->nmarks);
+        }
+        int lo = 0, hi = row->nmarks - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (row->marks[mid].col <= col) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        m = row->marks[lo];
+    }
+    int r = m.r, c = m.col, len;
+    while (r < row->rsize && c < col) {
+        c += charCols(renderChar(row, r, &len));
+        r += len;
+    }
+    while (r < row->rsize && charCols(renderChar(row, r, &len)) == 0) r += len;
+    if (c > col) *pad = c - col;
+    return r;
+}
+
+/* Byte offsets of the characters before and after position cx, and of the
+ * character that cx falls inside. */
+int charStart(erow *row, int cx) {
+    int i = cx;
+    while (i > 0 && i < row->size && cx - i < 3 && (ROWCHAR(row, i) & 0xc0) == 0x80) i--;
+    return i;
+}
+
+int charPrev(erow *row, int cx) {
+    int i = cx - 1;
+    while (i > 0 && cx - i < 4 && (ROWCHAR(row, i) & 0xc0) == 0x80) i--;
+    return i < 0 ? 0 : i;
+}
+
+int charNext(erow *row, int cx) {
+    int i = cx + 1;
+    while (i < row->size && i - cx < 4 && (ROWCHAR(row, i) & 0xc0) == 0x80) i++;
+    return i;
+}
+
+void rowInsertChar(erow *row, int idx, int c) {
+    if (idx < 0 || idx > row->size) idx = row->size;
+    rowOwn(row);
+    char ch = c;
+    undoRecord(UNDO_INSERT, rowIndex(row), idx, &ch, 1);
+
+    rowGapOpen(row, 1);
+    rowGapTo(row, idx);
+    row->chars[row->gap++] = c;
+    row->gaplen--;
+    row->size++;
+    renderInsert(row, &ch, 1);
+    colsEdited(row, idx);
+
+    rowEdited(row);
+}
+
+void rowInsertString(erow *row, int idx, char *s, size_t len) {
+    if (idx < 0 || idx > row->size) idx = row->size;
+    rowOwn(row);
+    undoRecord(UNDO_INSERT, rowIndex(row), idx, s, len);
+
+    rowGapOpen(row, len);
+    rowGapTo(row, idx);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->gaplen -= len;
+    row->size += len;
+    renderInsert(row, s, len);
+    colsEdited(row, idx);
+
+    rowEdited(row);
+}
+
+void rowDelChar(erow *row, int idx) {
+    if (idx < 0 || idx >= row->size) return;
+    rowOwn(row);
+    char c = ROWCHAR(row, idx);
+    undoRecord(UNDO_DELETE, rowIndex(row), idx, &c, 1);
+    rowGapOpen(row, 0);
+    rowGapTo(row, idx + 1);
+    row->gap--;
+    row->gaplen++;
+    row->size--;
+    renderDelete(row, c);
+    colsEdited(row, idx);
+    rowEdited(row);
+}
+
+void rowAppendString(erow *row, char *s, size_t len) {
+    undoRecord(UNDO_INSERT, rowIndex(row), row->size, s, len);
+    rowOwn(row);
+    rowFlatten(row);
+    row->chars = rowGrow(row->chars, &row->cap, row->size + 1, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    renderInsert(row, s, len);
+    colsEdited(row, row->size - len);
+    rowEdited(row);
+}
+
+void rowTruncate(erow *row, int len, int tabs) {
+    rowOwn(row);
+    rowFlatten(row);
+    undoRecord(UNDO_DELETE, rowIndex(row), len, &row->chars[len], row->size - len);
+    row->size = len;
+    row->chars[row->size] = '\0';
+    row->tabs -= tabs;
+    if (!row->rdirty && row->tabs == 0) {
+        renderAlias(row);
+    } else {
+        row->rdirty = 1;
+    }
+    colsEdited(row, len);
+    rowEdited(row);
+}
+
+
+void freeRow(erow *row) {
+    rowFree((char*) row->marks, row->markcap);
+    rowFree(row->hl, row->hlcap);
+    if (row->rcap < 0) {
+        S.elided += row->rcap;
+    } else {
+        rowFree(row->render, row->rcap);
+    }
+    rowRelease(row);
+}
+
+void delRow(int idx) {
+    if (idx < 0 || idx >= E.numrows) return;
+    erow *row = rowSlot(idx);
+    undoRecord(UNDO_DELROW, idx, 0, rowData(row), row->size);
+    freeRow(row);
+    treeDelete(idx);
+    hlInvalidate(idx);
+    E.mod = 1;
+    E.changes++;
+}
+void delChar() {
+    if (E.cy == E.numrows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+    erow *row = rowAt(E.cy);
+    if (E.cx > 0) {
+        int at = charPrev(row, E.cx);
+        while (E.cx > at) rowDelChar(row, --E.cx);
+    } else {
+        E.cx = rowAt(E.cy - 1)->size;
+        rowAppendString(rowAt(E.cy - 1), rowData(row), row->size);
+        delRow(E.cy);
+        E.cy--;
+    }
+}
+
+void insertChar(char c) {
+    if (E.cy == E.numrows) insertRow(E.numrows, "", 0);
+    rowInsertChar(rowAt(E.cy), E.cx, c);
+    E.cx++;
+}
+
+/* Inserts a block of text at the cursor, splitting it into rows on CR/LF,
+ * with one row operation per line rather than one per character. */
+void insertText(char *s, size_t len) {
+    if (E.cy == E.numrows) insertRow(E.numrows, "", 0);
+
+    char *nl = memchr(s, '\r', len);
+    char *lf = memchr(s, '\n', len);
+    if (nl == NULL || (lf && lf < nl)) nl = lf;
+    if (nl == NULL) {
+        rowInsertString(rowAt(E.cy), E.cx, s, len);
+        E.cx += len;
+        return;
+    }
+
+    erow *row = rowAt(E.cy);
+    int taillen = row->size - E.cx;
+    char *tail = (char*) malloc(taillen + 1);
+    memcpy(tail, &rowData(row)[E.cx], taillen);
+    int tabs = 0;
+    for (int i = 0; i < taillen; ++i) {
+        if (tail[i] == '\t') tabs++;
+    }
+    rowTruncate(row, E.cx, tabs);
+    rowAppendString(row, s, nl - s);
+
+    char *end = s + len;
+    char *p = nl;
+    while (p < end) {
+        if (*p == '\r' && p + 1 < end && p[1] == '\n') p++;
+        p++;
+        char *eol = p;
+        while (eol < end && *eol != '\r' && *eol != '\n') eol++;
+        E.cy++;
+        insertRow(E.cy, p, eol - p);
+        E.cx = eol - p;
+        p = eol;
+    }
+    rowAppendString(rowAt(E.cy), tail, taillen);
+    free(tail);
+}
+
+void pasteText() {
+    struct abuf ab = ABUF_INIT;
+    int idle = 0;
+    char c;
+    while (idle < PASTE_WAIT) {
+        if (!inputPeek(0, &c)) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        if (c == '\x1b') {
+            inputSkip(1);
+            if (readEscape() == PASTE_END) break;
+            continue;
+        }
+        int run = E.incount < INBUF_SIZE - E.inhead ? E.incount : INBUF_SIZE - E.inhead;
+        char *p = &E.inbuf[E.inhead];
+        char *esc = memchr(p, '\x1b', run);
+        if (esc) run = esc - p;
+        abAppend(&ab, p, run);
+        inputSkip(run);
+    }
+    if (ab.len) insertText(ab.b, ab.len);
+    abFree(&ab);
+}
+
+void insertNewline() {
+    if (E.cx == 0) {
+        insertRow(E.cy, "", 0);
+    } else {
+        erow *row = rowAt(E.cy);
+        insertRow(E.cy + 1, &rowData(row)[E.cx], row->size - E.cx);
+        int tabs = rowAt(E.cy + 1)->tabs;
+        row = rowAt(E.cy);
+        rowTruncate(row, E.cx, tabs);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void rowDelete(erow *row, int at, int len) {
+    if (len == 1) {
+        rowDelChar(row, at);
+        return;
+    }
+    char *s = rowData(row);
+    int tabs = 0;
+    for (int i = at; i < row->size; ++i) {
+        if (s[i] == '\t') tabs++;
+    }
+    int taillen = row->size - at - len;
+    char *tail = (char*) malloc(taillen + 1);
+    memcpy(tail, &s[at + len], taillen);
+    rowTruncate(row, at, tabs);
+    rowAppendString(row, tail, taillen);
+    free(tail);
+}
+
+void undoOp(struct uop *op, int redo) {
+    char *text = (char*) &op[1];
+    switch (op->type) {
+        case UNDO_INSERT:
+        case UNDO_DELETE:
+            if ((op->type == UNDO_INSERT) == redo) {
+                rowInsertString(rowAt(op->row), op->col, text, op->len);
+            } else {
+                rowDelete(rowAt(op->row), op->col, op->len);
+            }
+            break;
+        case UNDO_ADDROW:
+        case UNDO_DELROW:
+            if ((op->type == UNDO_ADDROW) == redo) {
+                insertRow(op->row, text, op->len);
+            } else {
+                delRow(op->row);
+            }
+            break;
+    }
+}
+
+void undoApply(int redo) {
+    if (redo ? U.cur == U.len : U.last < 0) {
+        setStatusMsg("Already at %s change", redo ? "newest" : "oldest");
+        return;
+    }
+    U.replay = 1;
+    int changes = 0;
+    if (redo) {
+        while (U.cur < U.len) {
+            struct uop *op = undoEntry(U.cur);
+            if (op->type == UNDO_STEP && changes++) break;
+            if (op->type != UNDO_STEP) {
+                if (changes++ == 1) {
+                    E.cy = op->row;
+                    E.cx = op->col;
+                }
+                undoOp(op, 1);
+            }
+            U.last = U.cur;
+            U.cur += undoSize(op);
+        }
+    } else {
+        while (U.last >= 0) {
+            struct uop *op = undoEntry(U.last);
+            U.cur = U.last;
+            U.last = op->back ? U.last - op->back : -1;
+            if (op->type == UNDO_STEP) {
+                E.cy = op->row;
+                E.cx = op->col;
+                break;
+            }
+            undoOp(op, 0);
+        }
+    }
+    U.replay = 0;
+    U.brk = 1;
+    E.mod = U.cur != U.saved;
+
+    if (E.cy > E.numrows) E.cy = E.numrows;
+    int size = E.cy < E.numrows ? rowAt(E.cy)->size : 0;
+    if (E.cx > size) E.cx = size;
+    if (E.mode == NORMAL && E.cx == size && E.cx > 0) E.cx--;
+}
+
+char newline[] = "\n";
+
+/* Spans normally hold exactly the bytes they write, but lines ending in
+ * CRLF inside one lose their CRs on the way out. */
+int spanHasCR(erow *span) {
+    return memchr(E.map + span->off, '\r', span->size) != NULL;
+}
+
+double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int writeAll(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void piecePush(int kind, char *p, size_t len, int size) {
+    struct piece *last = W.cnt ? &W.pieces[W.cnt - 1] : NULL;
+    if (kind == PIECE_RAW && last && last->kind == PIECE_RAW && last->p + last->len == p) {
+        last->len += len;
+    } else {
+        if (W.cnt == W.cap) {
+            W.cap = W.cap ? W.cap * 2 : IOV_BATCH;
+            W.pieces = realloc(W.pieces, sizeof(struct piece) * W.cap);
+            if (W.pieces == NULL) die("realloc");
+        }
+        W.pieces[W.cnt++] = (struct piece) {p, len, size, kind};
+    }
+    W.len += (kind == PIECE_PACK ? (size_t) size : len) + (kind != PIECE_RAW);
+}
+
+/* Snapshots the buffer as a list of pieces for the save thread. Nothing
+ * is copied: the mapping and packed chunks never change in place, and
+ * resident rows are stamped with the save's generation so that editing
+ * or freeing one first hands its text over (see rowOwn). Unpacking and
+ * adding newlines is left to the thread. */
+void rowsGather() {
+    W.gen++;
+    W.cnt = 0;
+    W.len = 0;
+    for (int i = 0; i < E.numrows; i = E.leafbase + E.leaf->count) {
+        lnode *leaf = leafAt(i);
+        if (leaf->pack) {
+            for (int k = 0; k < leaf->npack; ++k) {
+                struct chunk *c = &leaf->pack[k];
+                piecePush(PIECE_PACK, c->data, c->len, c->size);
+            }
+            continue;
+        }
+        for (int j = 0; j < leaf->n; ++j) {
+            erow *row = &leaf->u.row[j];
+            char *data = rowData(row);
+            if (row->chars) {
+                row->wgen = W.gen;
+                piecePush(PIECE_LINE, data, row->size, 0);
+            } else if (leaf->leaf == LEAF_SPAN && spanHasCR(row)) {
+                char *end = data + row->size;
+                int len;
+                while (1) {
+                    char *eol = lineEnd(data, end, &len);
+                    piecePush(PIECE_LINE, data, len, 0);
+                    if (eol == end) break;
+                    data = eol + 1;
+                }
+            } else if ((size_t) (row->off + row->size) < E.mapsize && data[row->size] == '\n') {
+                piecePush(PIECE_RAW, data, row->size + 1, 0);
+            } else {
+                piecePush(PIECE_LINE, data, row->size, 0);
+            }
+        }
+    }
+}
+
+/* Turns the pieces into batches of iovecs. Chunks are unpacked into a
+ * scratch buffer that is only reused once the batch pointing into it has
+ * been written. */
+int saveWrite(int fd) {
+    char *scratch = NULL;
+    int scap = 0, n = 0, ok = 0;
+    size_t used = 0;
+    for (int i = 0; i < W.cnt && ok == 0; ++i) {
+        struct piece *pc = &W.pieces[i];
+        if (n + 2 > IOV_BATCH || (pc->kind == PIECE_PACK && used + pc->size + 1 > (size_t) scap)) {
+            ok = writeAll(fd, W.iov, n);
+            n = 0;
+            used = 0;
+            if (ok) break;
+        }
+        if (pc->kind == PIECE_PACK) {
+            if (pc->size + 1 > scap) {
+                scap = pc->size + 1 > SAVE_SCRATCH ? pc->size + 1 : SAVE_SCRATCH;
+                free(scratch);
+                scratch = malloc(scap);
+                if (scratch == NULL) die("malloc");
+            }
+            char *p = &scratch[used];
+            if (unpackBlock(pc->p, pc->len, p) != pc->size) die("unpack");
+            p[pc->size] = '\n';
+            W.iov[n++] = (struct iovec) {p, pc->size + 1};
+            used += pc->size + 1;
+        } else {
+            W.iov[n++] = (struct iovec) {pc->p, pc->len};
+            if (pc->kind == PIECE_LINE) W.iov[n++] = (struct iovec) {newline, 1};
+        }
+    }
+    if (ok == 0) ok = writeAll(fd, W.iov, n);
+    free(scratch);
+    return ok;
+}
+
+/* Writes the snapshot to the temp file, syncs it, renames it over the
+ * original and syncs the directory. Runs on its own thread. */
+void *saveThread(void *arg) {
+    (void) arg;
+    int stage = SAVE_OPEN;
+    int fd = open(W.tmpname, O_RDWR | O_CREAT, 0644);
+    if (fd != -1) {
+        stage = SAVE_TRUNCATE;
+        if (ftruncate(fd, W.len) != -1) {
+            stage = SAVE_WRITE;
+            if (saveWrite(fd) == 0) {
+                stage = SAVE_SYNC;
+                if (fsync(fd) != -1 && fstat(fd, &W.st) != -1) stage = SAVE_RENAME;
+            }
+        }
+        W.err = errno;
+        close(fd);
+        if (stage == SAVE_RENAME && rename(W.tmpname, W.filename) != -1) {
+            stage = SAVE_OK;
+            char *slash = strrchr(W.filename, '/');
+            char *dir = slash ? strndup(W.filename, slash - W.filename + 1) : strdup(".");
+            int dfd = open(dir, O_RDONLY);
+            if (dfd != -1) {
+                fsync(dfd);
+                close(dfd);
+            }
+            free(dir);
+        } else if (stage == SAVE_RENAME) {
+            W.err = errno;
+        } else {
+            unlink(W.tmpname);
+        }
+    } else {
+        W.err = errno;
+    }
+    W.secs = elapsed(&W.start);
+    pthread_mutex_lock(&W.lock);
+    W.stage = stage;
+    W.done = 1;
+    pthread_mutex_unlock(&W.lock);
+    write(E.wakefd[1], "s", 1);
+    return NULL;
+}
+
+unsigned journalSum(const char *p, long len) {
+    unsigned h = 2166136261u;
+    for (long i = 0; i < len; ++i) h = (h ^ (unsigned char) p[i]) * 16777619u;
+    return h;
+}
+
+struct uop *journalEntry(long off) {
+    return (struct uop*) &J.buf[off];
+}
+
+void journalGrow(long need) {
+    if (need <= J.cap) return;
+    J.cap = need > J.cap * 2 ? need : J.cap * 2;
+    J.buf = realloc(J.buf, J.cap);
+    if (J.buf == NULL) die("realloc");
+}
+
+void journalPush(int type, int row, int col, const char *s, int len) {
+    journalGrow(J.len + sizeof(struct uop) + len + 4);
+    struct uop *op = journalEntry(J.len);
+    memset(op, 0, sizeof(struct uop) + len + 4);
+    op->type = type;
+    op->row = row;
+    op->col = col;
+    op->len = len;
+    if (len) memcpy(&op[1], s, len);
+    J.last = J.len;
+    J.len += undoSize(op);
+}
+
+/* Called for every row operation, including undo and redo, so the
+ * journal replays forwards. Typing runs are merged as in the undo log. */
+void journalPut(int type, int row, int col, const char *s, int len) {
+    if (J.fd == -1 || J.replay || row < 0) return;
+    struct uop *op = J.last >= 0 ? journalEntry(J.last) : NULL;
+    if (op && type == UNDO_INSERT && op->type == UNDO_INSERT && op->row == row && op->col + op->len == col) {
+        journalGrow(J.last + sizeof(struct uop) + op->len + len + 4);
+        op = journalEntry(J.last);
+        char *text = (char*) &op[1];
+        memcpy(&text[op->len], s, len);
+        op->len += len;
+        memset(&text[op->len], 0, 3);
+        J.len = J.last + undoSize(op);
+    } else {
+        journalPush(type, row, col, s, len);
+    }
+    if (J.len >= JOURNAL_FLUSH) journalFlush();
+}
+
+/* Seals the pending batch and appends it with a single write. Syncs are
+ * rate limited; a batch torn by a crash fails its checksum on replay. */
+void journalFlush() {
+    if (J.fd == -1 || J.len == 0) return;
+    unsigned sum = journalSum(J.buf, J.len);
+    journalPush(UNDO_STEP, E.cy, E.cx, NULL, 0);
+    journalEntry(J.last)->back = (int) sum;
+    long len = J.len;
+    J.len = 0;
+    J.last = -1;
+    if (pwrite(J.fd, J.buf, len, J.end) != len) {
+        setStatusMsg("Journal write failed, journaling off: %s", strerror(errno));
+        close(J.fd);
+        J.fd = -1;
+        return;
+    }
+    S.jbytes += len;
+    J.end += len;
+    if (elapsed(&J.synced) >= JOURNAL_SYNC) {
+        fdatasync(J.fd);
+        clock_gettime(CLOCK_MONOTONIC, &J.synced);
+        S.jsyncs++;
+    }
+}
+
+void journalHead(struct jhead *head, struct stat *st) {
+    memset(head, 0, sizeof(*head));
+    memcpy(head->magic, JOURNAL_MAGIC, sizeof(head->magic));
+    head->size = st->st_size;
+    head->sec = st->st_mtim.tv_sec;
+    head->nsec = st->st_mtim.tv_nsec;
+}
+
+/* Rewrites the journal as a header naming the file on disk followed by
+ * the entries from mark on, i.e. those the file doesn't contain yet. */
+void journalRebase(struct stat *st) {
+    if (J.fd == -1) return;
+    journalFlush();
+    long tail = J.end - J.mark;
+    long size = sizeof(struct jhead) + tail;
+    char *buf = malloc(size);
+    if (buf == NULL) die("malloc");
+    journalHead((struct jhead*) buf, st);
+    if ((tail && pread(J.fd, &buf[sizeof(struct jhead)], tail, J.mark) != tail) ||
+            pwrite(J.fd, buf, size, 0) != size || ftruncate(J.fd, size) == -1) {
+        setStatusMsg("Journal rewrite failed, journaling off: %s", strerror(errno));
+        close(J.fd);
+        J.fd = -1;
+    } else {
+        fdatasync(J.fd);
+        clock_gettime(CLOCK_MONOTONIC, &J.synced);
+        S.jsyncs++;
+    }
+    J.end = J.mark = size;
+    free(buf);
+}
+
+/* Applies one sealed batch, checking each entry against the buffer. */
+int journalApply(char *p, char *end) {
+    undoBreak();
+    while (p < end) {
+        struct uop *op = (struct uop*) p;
+        if (op->type < UNDO_INSERT || op->type > UNDO_DELROW || op->row < 0) return 0;
+        if (op->row > (op->type == UNDO_ADDROW ? E.numrows : E.numrows - 1)) return 0;
+        if (op->type == UNDO_INSERT && (op->col < 0 || op->col > rowAt(op->row)->size)) return 0;
+        if (op->type == UNDO_DELETE && (op->col < 0 || op->col + op->len > rowAt(op->row)->size)) return 0;
+        undoOp(op, 1);
+        p += undoSize(op);
+    }
+    return 1;
+}
+
+/* Replays the sealed batches of a journal left behind by a session that
+ * didn't exit cleanly, stopping at the first torn or damaged one. A
+ * journal written against another version of the file is left alone
+ * and journaling stays off. */
+void journalRecover(struct stat *st, off_t size) {
+    struct jhead head;
+    journalHead(&head, st);
+    char *buf = malloc(size);
+    if (buf == NULL) die("malloc");
+    if (size < (off_t) sizeof(head) || pread(J.fd, buf, size, 0) != size || memcmp(buf, &head, sizeof(head)) != 0) {
+        setStatusMsg("Journal \"%s\" doesn't match the file, not recovered", J.name);
+        free(buf);
+        close(J.fd);
+        J.fd = -1;
+        return;
+    }
+    off_t seg = sizeof(head);
+    off_t off = seg;
+    int batches = 0;
+    J.replay = 1;
+    while (off + (off_t) sizeof(struct uop) <= size) {
+        struct uop *op = (struct uop*) &buf[off];
+        if (op->len < 0 || off + undoSize(op) > size) break;
+        if (op->type == UNDO_STEP) {
+            if ((unsigned) op->back != journalSum(&buf[seg], off - seg)) break;
+            if (!journalApply(&buf[seg], &buf[off])) break;
+            E.cy = op->row;
+            E.cx = op->col;
+            batches++;
+            seg = off + undoSize(op);
+        }
+        off += undoSize(op);
+    }
+    J.replay = 0;
+    free(buf);
+    undoBreak();
+    J.end = J.mark = seg;
+    if (seg < size && ftruncate(J.fd, seg) == -1) {
+        close(J.fd);
+        J.fd = -1;
+    }
+
+    if (E.cy < 0 || E.cy > E.numrows) E.cy = 0;
+    int rowsize = E.cy < E.numrows ? rowAt(E.cy)->size : 0;
+    if (E.cx < 0 || E.cx > rowsize) E.cx = 0;
+    if (E.cx == rowsize && E.cx > 0) E.cx--;
+    if (batches) {
+        setStatusMsg("Recovered %d edit batch%s from \"%s\"", batches, batches == 1 ? "" : "es", J.name);
+    }
+}
+
+void journalOpen(struct stat *st) {
+    if (!J.on) return;
+    int len = strlen(E.filename) + strlen(E.journalExt) + 1;
+    free(J.name);
+    J.name = (char*) malloc(len);
+    snprintf(J.name, len, "%s%s", E.filename, E.journalExt);
+    J.len = 0;
+    J.last = -1;
+    clock_gettime(CLOCK_MONOTONIC, &J.synced);
+    J.fd = open(J.name, O_RDWR | O_CREAT, 0600);
+    if (J.fd == -1) {
+        setStatusMsg("Couldn't open journal \"%s\": %s", J.name, strerror(errno));
+        return;
+    }
+    struct stat js;
+    if (fstat(J.fd, &js) == 0 && js.st_size > 0) {
+        journalRecover(st, js.st_size);
+        return;
+    }
+    struct jhead head;
+    journalHead(&head, st);
+    if (pwrite(J.fd, &head, sizeof(head), 0) != sizeof(head)) {
+        setStatusMsg("Couldn't write journal \"%s\": %s", J.name, strerror(errno));
+        close(J.fd);
+        J.fd = -1;
+        return;
+    }
+    J.end = J.mark = sizeof(head);
+}
+
+/* A deliberate quit leaves nothing to recover. */
+void journalClose(struct journal *j) {
+    if (j->fd == -1) return;
+    close(j->fd);
+    j->fd = -1;
+    unlink(j->name);
+}
+
+void saveFinish() {
+    if (W.threaded) pthread_join(W.thread, NULL);
+    W.busy = 0;
+    W.done = 0;
+    switch (W.stage) {
+        case SAVE_OK:
+            S.savetime = W.secs;
+            setStatusMsg("\"%s\" %dL, %lldB written, %.1f MB/s", W.filename, W.rows, (long long) W.len, W.secs > 0 ? W.len / W.secs / 1e6 : 0.0);
+            if (E.changes == W.changes) {
+                E.mod = 0;
+                U.saved = U.cur;
+            }
+            journalRebase(&W.st);
+            break;
+        case SAVE_OPEN:
+            setStatusMsg("Couldn't create \"%s\": %s", W.tmpname, strerror(W.err));
+            break;
+        case SAVE_TRUNCATE:
+            setStatusMsg("ftruncate failed: %s", strerror(W.err));
+            break;
+        case SAVE_WRITE:
+        case SAVE_SYNC:
+            setStatusMsg("Failed to write changes to temp file: %s", strerror(W.err));
+            break;
+        case SAVE_RENAME:
+            setStatusMsg("Couldn't overwrite \"%s\": %s", W.filename, strerror(W.err));
+            break;
+    }
+    for (int i = 0; i < W.nheld; ++i) {
+        if (W.held[i].cap == -1) {
+            free(W.held[i].p);
+        } else {
+            rowFree(W.held[i].p, W.held[i].cap);
+        }
+    }
+    W.nheld = 0;
+    free(W.filename);
+    free(W.tmpname);
+    W.filename = W.tmpname = NULL;
+}
+
+/* Polled while idle; returns 1 once a finished save has been reported. */
+int saveCheck() {
+    if (!W.busy) return 0;
+    pthread_mutex_lock(&W.lock);
+    _Bool done = W.done;
+    pthread_mutex_unlock(&W.lock);
+    if (!done) return 0;
+    saveFinish();
+    return 1;
+}
+
+void saveWait() {
+    if (W.busy) saveFinish();
+}
+
+void fileSave() {
+    if (E.filename == NULL) {
+        E.filename = commandPrompt("Save as: %s [ESC to Cancel]", NULL);
+        if (E.filename == NULL) {
+            setStatusMsg("Save Aborted");
+            return;
+        }
+        selectSyntax();
+    }
+    saveWait();
+    clock_gettime(CLOCK_MONOTONIC, &W.start);
+    int filenameLen = strlen(E.filename);
+    int tmpExtLen = strlen(E.tmpFileExt);
+    int tmpFilenameLen = filenameLen + tmpExtLen + 1;
+    W.tmpname = (char*) malloc(tmpFilenameLen);
+    memcpy(W.tmpname, E.filename, filenameLen);
+    memcpy(&W.tmpname[filenameLen], E.tmpFileExt, tmpExtLen);
+    W.tmpname[tmpFilenameLen - 1] = '\0';
+    W.filename = strdup(E.filename);
+    W.rows = E.numrows;
+    W.changes = E.changes;
+    journalFlush();
+    J.mark = J.end;
+    if (W.iov == NULL) {
+        W.iov = malloc(sizeof(struct iovec) * IOV_BATCH);
+        if (W.iov == NULL) die("malloc");
+    }
+    rowsGather();
+
+    W.busy = 1;
+    W.done = 0;
+    W.threaded = pthread_create(&W.thread, NULL, saveThread, NULL) == 0;
+    if (!W.threaded) {
+        saveThread(NULL);
+        saveFinish();
+        return;
+    }
+    setStatusMsg("Saving \"%s\"...", E.filename);
+}
+
+/* Each scan thread cuts its slice of the file into span-sized runs of
+ * lines as it goes, so indexing keeps one entry per span rather than
+ * one per line. A slice's first newline always ends a run: the run
+ * begun in the slice before it is finished there. */
+typedef struct scanjob {
+    const char *p;
+    size_t len;
+    size_t base;
+    size_t first;
+    int count;
+    size_t after;
+    size_t *ends;
+    int *lines;
+    size_t n;
+    size_t cap;
+} scanjob;
+
+typedef void (*scanfn)(scanjob *);
+
+void scanPush(scanjob *job, size_t pos) {
+    job->count++;
+    job->after = job->base + pos + 1;
+    if (job->count < SPAN_LINES && pos + 1 - job->first <= SPAN_BYTES && (job->n || !job->base)) return;
+    if (job->n == job->cap) {
+        job->cap = job->cap ? job->cap * 2 : 64;
+        job->ends = realloc(job->ends, sizeof(size_t) * job->cap);
+        job->lines = realloc(job->lines, sizeof(int) * job->cap);
+        if (job->ends == NULL || job->lines == NULL) die("realloc");
+    }
+    job->ends[job->n] = job->base + pos;
+    job->lines[job->n++] = job->count;
+    job->first = pos + 1;
+    job->count = 0;
+}
+
+void scanScalar(scanjob *job) {
+    const char *p = job->p;
+    const char *end = job->p + job->len;
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        scanPush(job, p - job->p);
+        p++;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void scanSSE2(scanjob *job) {
+    __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= job->len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (job->p + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            scanPush(job, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < job->len; ++i) {
+        if (job->p[i] == '\n') scanPush(job, i);
+    }
+}
+
+__attribute__((target("avx2")))
+void scanAVX2(scanjob *job) {
+    __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= job->len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (job->p + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        while (mask) {
+            scanPush(job, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < job->len; ++i) {
+        if (job->p[i] == '\n') scanPush(job, i);
+    }
+}
+#endif
+
+scanfn scanKernel() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scanAVX2;
+    if (__builtin_cpu_supports("sse2")) return scanSSE2;
+#endif
+    return scanScalar;
+}
+
+scanfn scanLines;
+
+typedef int (*findfn)(const char *, int, const char *, int);
+
+int findScalar(const char *s, int len, const char *q, int qlen) {
+    if (len < qlen) return -1;
+    const char *p = s;
+    const char *end = s + len - qlen + 1;
+    while (p < end && (p = memchr(p, q[0], end - p)) != NULL) {
+        if (memcmp(p, q, qlen) == 0) return p - s;
+        p++;
+    }
+    return -1;
+}
+
+/* Candidates are positions where both the first and the last byte of the
+ * needle match; only those are verified with memcmp. */
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+int findSSE2(const char *s, int len, const char *q, int qlen) {
+    if (len < qlen) return -1;
+    __m128i first = _mm_set1_epi8(q[0]);
+    __m128i last = _mm_set1_epi8(q[qlen - 1]);
+    int i = 0;
+    for (; i + qlen - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (s + i + qlen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int at = i + __builtin_ctz(mask);
+            if (memcmp(s + at, q, qlen) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    int m = findScalar(s + i, len - i, q, qlen);
+    return m == -1 ? -1 : i + m;
+}
+
+__attribute__((target("avx2")))
+int findAVX2(const char *s, int len, const char *q, int qlen) {
+    if (len < qlen) return -1;
+    __m256i first = _mm256_set1_epi8(q[0]);
+    __m256i last = _mm256_set1_epi8(q[qlen - 1]);
+    int i = 0;
+    for (; i + qlen - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (s + i + qlen - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int at = i + __builtin_ctz(mask);
+            if (memcmp(s + at, q, qlen) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    int m = findScalar(s + i, len - i, q, qlen);
+    return m == -1 ? -1 : i + m;
+}
+#endif
+
+findfn findKernel() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return findAVX2;
+    if (__builtin_cpu_supports("sse2")) return findSSE2;
+#endif
+    return findScalar;
+}
+
+findfn findText;
+
+void *scanThread(void *arg) {
+    scanLines((scanjob*) arg);
+    return NULL;
+}
+
+/* Build the tree bottom-up from full leaves; only valid on an empty buffer. */
+void treeBuild(lnode **nodes, int n) {
+    while (n > 1) {
+        int parents = 0;
+        for (int i = 0; i < n; i += NODE_KIDS) {
+            lnode *parent = nodeNew(0);
+            for (int j = i; j < n && j < i + NODE_KIDS; ++j) parent->u.kid[parent->n++] = nodes[j];
+            nodeCount(parent);
+            nodes[parents++] = parent;
+        }
+        n = parents;
+    }
+    nodeFree(E.rows);
+    E.rows = n ? nodes[0] : nodeNew(1);
+    E.numrows = E.rows->count;
+    E.leaf = NULL;
+}
+
+void fileIndex() {
+    if (scanLines == NULL) scanLines = scanKernel();
+
+    int njobs = E.mapsize / SCAN_CHUNK + 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (njobs > cpus) njobs = cpus > 0 ? cpus : 1;
+    if (njobs > SCAN_THREADS) njobs = SCAN_THREADS;
+
+    scanjob jobs[SCAN_THREADS];
+    pthread_t threads[SCAN_THREADS];
+    memset(jobs, 0, sizeof(jobs));
+    size_t chunk = E.mapsize / njobs;
+    for (int i = 0; i < njobs; ++i) {
+        jobs[i].base = i * chunk;
+        jobs[i].p = E.map + jobs[i].base;
+        jobs[i].len = (i == njobs - 1) ? E.mapsize - jobs[i].base : chunk;
+    }
+    int started = 1;
+    for (; started < njobs; ++started) {
+        if (pthread_create(&threads[started], NULL, scanThread, &jobs[started]) != 0) break;
+    }
+    scanLines(&jobs[0]);
+    for (int i = 1; i < njobs; ++i) {
+        if (i < started) {
+            pthread_join(threads[i], NULL);
+        } else {
+            scanLines(&jobs[i]);
+        }
+    }
+
+    size_t cuts = 1;
+    for (int i = 0; i < njobs; ++i) cuts += jobs[i].n;
+    int nleaves = 0;
+    lnode **leaves = (lnode**) malloc(sizeof(lnode*) * cuts);
+    if (leaves == NULL) die("malloc");
+
+    /* Runs become spans; only the lines that get looked at become rows.
+     * Lines left after a slice's last cut carry into the next run. */
+    size_t start = 0, after = 0;
+    int carry = 0;
+    for (int i = 0; i <= njobs; ++i) {
+        size_t n = i < njobs ? jobs[i].n : (carry || start < E.mapsize);
+        for (size_t j = 0; j < n; ++j) {
+            size_t eol = i < njobs ? jobs[i].ends[j] : after < E.mapsize ? E.mapsize : after - 1;
+            int lines = carry + (i < njobs ? jobs[i].lines[j] : after < E.mapsize);
+            size_t end = eol;
+            while (end > start && E.map[end - 1] == '\r') end--;
+            leaves[nleaves++] = spanNew(start, end - start, lines);
+            start = eol + 1;
+            carry = 0;
+        }
+        if (i < njobs) {
+            carry += jobs[i].count;
+            if (jobs[i].after) after = jobs[i].after;
+            free(jobs[i].ends);
+            free(jobs[i].lines);
+        }
+    }
+    treeBuild(leaves, nleaves);
+    free(leaves);
+}
+
+void fileRead(int fd) {
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) die("fdopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1){
+        if (linelen != -1) {
+            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
+            insertRow(E.numrows, line, linelen);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+void fileOpen(char* filename) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* free(E.filename); */
+    E.filename = strdup(filename);
+
+    /* Only the mapping reads the file; saving goes through a temp file,
+     * so a read-only file opens fine and any failure shows up at :w. */
+    if (access(E.filename, F_OK) != 0) {
+        int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+        if (fd != -1) close(fd);
+    }
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1) die("open");
+    undoReset();
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (E.map == MAP_FAILED) E.map = NULL;
+    }
+    if (E.map) {
+        E.mapsize = st.st_size;
+        close(fd);
+        fileIndex();
+    } else {
+        fileRead(fd);
+    }
+
+    E.mod = 0;
+    selectSyntax();
+    journalOpen(&st);
+    S.opentime = elapsed(&start);
+}
+
+int streamHere() {
+    return P.fd != -1 && P.buf == L.cur;
+}
+
+/* Streamed rows are appended straight to the tree: they are the file's
+ * contents, not edits, so they bypass the undo log and the journal. */
+void streamRow(char *s, int len) {
+    while (len > 0 && s[len - 1] == '\r') len--;
+    if (E.numrows > 0) rowSlot(E.numrows - 1);
+    erow row;
+    rowInit(&row, 0, len);
+    row.chars = rowAlloc(len + 1, &row.cap);
+    memcpy(row.chars, s, len);
+    row.chars[len] = '\0';
+    row.dirty = 1;
+    updateRow(&row);
+    treeInsert(E.numrows, &row);
+    E.expanded++;
+}
+
+void streamLines(char *s, int n) {
+    char *end = s + n;
+    char *nl;
+    while ((nl = memchr(s, '\n', end - s)) != NULL) {
+        if (P.len) {
+            P.part = rowGrow(P.part, &P.cap, P.len, P.len + (nl - s));
+            memcpy(&P.part[P.len], s, nl - s);
+            streamRow(P.part, P.len + (nl - s));
+            P.len = 0;
+        } else {
+            streamRow(s, nl - s);
+        }
+        s = nl + 1;
+    }
+    if (s < end) {
+        P.part = rowGrow(P.part, &P.cap, P.len, P.len + (end - s));
+        memcpy(&P.part[P.len], s, end - s);
+        P.len += end - s;
+    }
+}
+
+/* Reads what the pipe has, up to STREAM_BUDGET bytes so keys are not
+ * held up by a fast writer. In follow mode a cursor on the last row
+ * stays on the last row. */
+void streamRead() {
+    char buf[STREAM_CHUNK];
+    _Bool tail = P.follow && E.cy >= E.numrows - 1;
+    long got = 0;
+    while (got < STREAM_BUDGET) {
+        ssize_t n = read(P.fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) break;
+        if (n <= 0) {
+            if (P.len) streamRow(P.part, P.len);
+            rowFree(P.part, P.cap);
+            P.part = NULL;
+            P.len = P.cap = 0;
+            close(P.fd);
+            P.fd = -1;
+            setStatusMsg("\"[stdin]\" %dL, %ldB read", E.numrows, P.bytes + got);
+            break;
+        }
+        streamLines(buf, n);
+        got += n;
+    }
+    P.bytes += got;
+    if (tail && E.numrows > 0) {
+        E.cy = E.numrows - 1;
+        E.cx = 0;
+    }
+}
+
+/* When stdin is a pipe, keys come from the controlling terminal instead.
+ * It goes where stdin was so the terminal setup doesn't change, and the
+ * pipe is handed back to be streamed. */
+int ttyTake() {
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+        perror("/dev/tty");
+        exit(1);
+    }
+    close(tty);
+    return fd;
+}
+
+void streamOpen(int fd) {
+    P.fd = fd;
+    fcntl(P.fd, F_SETFL, fcntl(P.fd, F_GETFL) | O_NONBLOCK);
+    P.buf = L.cur;
+    streamRead();
+}
+
+void streamFollow() {
+    if (P.buf != L.cur) {
+        setStatusMsg("This buffer isn't reading a stream");
+        return;
+    }
+    P.follow = !P.follow;
+    if (P.follow && E.numrows > 0) {
+        E.cy = E.numrows - 1;
+        E.cx = 0;
+    }
+    setStatusMsg(P.follow ? "Following the end of the stream" : "Stopped following");
+}
+
+/* True when next starts the line after one ending at end in the mapping. */
+int mapFollows(off_t end, off_t next) {
+    if (next <= end || E.map[next - 1] != '\n') return 0;
+    for (off_t k = end; k < next - 1; ++k) {
+        if (E.map[k] != '\r') return 0;
+    }
+    return 1;
+}
+
+/* Packs a leaf whose rows can't fold back into the mapping. Rows ending
+ * in a CR stay as they are, since reading the lines back drops it. */
+void leafPack(lnode *leaf, _Bool hlok) {
+    int size = -1;
+    if (leaf->n == 0) return;
+    for (int i = 0; i < leaf->n; ++i) {
+        erow *row = &leaf->u.row[i];
+        if (row->size && rowData(row)[row->size - 1] == '\r') return;
+        size += row->size + 1;
+    }
+    char *p = packGrow(&K.raw, &K.rawcap, size + 1);
+    packGrow(&K.out, &K.outcap, packBound(size));
+    for (int i = 0; i < leaf->n; ++i) {
+        erow *row = &leaf->u.row[i];
+        memcpy(p, rowData(row), row->size);
+        p += row->size;
+        *p++ = '\n';
+    }
+    struct chunk c = {NULL, packBlock(K.raw, size, K.out), size, leaf->n};
+    c.data = malloc(c.len);
+    leaf->pack = malloc(sizeof(struct chunk));
+    if (c.data == NULL || leaf->pack == NULL) die("malloc");
+    memcpy(c.data, K.out, c.len);
+    leaf->pack[0] = c;
+    leaf->npack = 1;
+
+    erow span;
+    rowInit(&span, 0, size);
+    span.dirty = 1;
+    span.hlok = hlok;
+    span.hlin = leaf->u.row[0].hlin;
+    span.hlend = leaf->u.row[leaf->n - 1].hlend;
+    for (int i = 0; i < leaf->n; ++i) freeRow(&leaf->u.row[i]);
+    leaf->u.row[0] = span;
+    leaf->n = 1;
+    leaf->leaf = LEAF_SPAN;
+    S.packraw += c.size;
+    S.packbytes += c.len;
+    S.packs++;
+}
+
+/* Turns a leaf of unedited rows back into a span over the mapping, or
+ * packs it when some of them only exist in memory. */
+void leafFold(lnode *leaf) {
+    erow *first = &leaf->u.row[0];
+    erow *last = &leaf->u.row[leaf->n - 1];
+    _Bool hlok = 1, mapped = E.map != NULL;
+    for (int i = 0; i < leaf->n; ++i) {
+        erow *row = &leaf->u.row[i];
+        hlok = hlok && row->hlok && (i == 0 || row->hlin == row[-1].hlend);
+        if (row->dirty || (i && mapped && !mapFollows(row[-1].off + row[-1].size, row->off))) mapped = 0;
+    }
+    if (!mapped) {
+        if (leaf->seen != E.trimgen) leafPack(leaf, hlok);
+        return;
+    }
+    if (last->off + last->size - first->off > SPAN_BYTES) return;
+    erow span;
+    rowInit(&span, first->off, last->off + last->size - first->off);
+    span.hlok = hlok;
+    span.hlin = first->hlin;
+    span.hlend = last->hlend;
+    for (int i = 0; i < leaf->n; ++i) freeRow(&leaf->u.row[i]);
+    leaf->u.row[0] = span;
+    leaf->n = 1;
+    leaf->leaf = LEAF_SPAN;
+    S.collapses++;
+}
+
+/* Neighbouring spans merge: mapped ones when their bytes are adjacent,
+ * packed ones up to PACK_LINES by taking over each other's chunks. */
+int spanJoin(lnode *a, lnode *b) {
+    if (a->leaf != LEAF_SPAN || b->leaf != LEAF_SPAN) return 0;
+    erow *x = &a->u.row[0];
+    erow *y = &b->u.row[0];
+    if (a->pack || b->pack) {
+        if (!a->pack || !b->pack || a->count + b->count > PACK_LINES) return 0;
+        struct chunk *pack = realloc(a->pack, sizeof(struct chunk) * (a->npack + b->npack));
+        if (pack == NULL) die("realloc");
+        memcpy(&pack[a->npack], b->pack, sizeof(struct chunk) * b->npack);
+        a->pack = pack;
+        a->npack += b->npack;
+        free(b->pack);
+        if (K.span == a || K.span == b) K.span = NULL;
+        x->size += y->size + 1;
+    } else {
+        if (!mapFollows(x->off + x->size, y->off) || y->off + y->size - x->off > SPAN_BYTES) return 0;
+        x->size = y->off + y->size - x->off;
+    }
+    x->hlok = x->hlok && y->hlok && x->hlend == y->hlin;
+    x->hlend = y->hlend;
+    a->count += b->count;
+    if (a->vgen == b->vgen) {
+        a->vcount += b->vcount;
+    } else {
+        a->vgen = 0;
+    }
+    free(b);
+    return 1;
+}
+
+void nodeTrim(lnode *node, int base, int lo, int hi) {
+    if (!node->u.kid[0]->leaf) {
+        for (int i = 0; i < node->n; ++i) {
+            nodeTrim(node->u.kid[i], base, lo, hi);
+            base += node->u.kid[i]->count;
+        }
+        return;
+    }
+    for (int i = 0; i < node->n; ++i) {
+        lnode *kid = node->u.kid[i];
+        if (kid->leaf != LEAF_SPAN && (base + kid->count <= lo || base >= hi)) leafFold(kid);
+        base += kid->count;
+    }
+    for (int i = 0; i + 1 < node->n;) {
+        if (spanJoin(node->u.kid[i], node->u.kid[i + 1])) {
+            kidRemove(node, i + 1);
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Rows on screen are split out of their spans before anything looks at
+ * them. Once enough rows have been split out since the last pass, leaves
+ * away from the screen are folded back into spans, or packed when they
+ * hold edits and sat out the whole last pass, so what stays resident is
+ * about WINDOW_ROWS rows plus what was touched since then. */
+void windowSync() {
+    for (int y = 0; y < E.screenrows && E.rowoff + y < E.numrows; ++y) {
+        rowSlot(E.rowoff + y);
+        E.leaf->seen = E.trimgen;
+    }
+    if (E.expanded < WINDOW_ROWS || E.rows->leaf) return;
+    nodeTrim(E.rows, 0, E.rowoff - WINDOW_ROWS / 4, E.rowoff + E.screenrows + WINDOW_ROWS / 4);
+    E.trimgen++;
+    E.leaf = NULL;
+    E.expanded = 0;
+}
+
+long nodeUsed(lnode *node) {
+    long used = sizeof(lnode);
+    for (int i = 0; i < node->n; ++i) {
+        if (!node->leaf) {
+            used += nodeUsed(node->u.kid[i]);
+        } else if (node->pack) {
+            for (int j = 0; j < node->npack; ++j) used += node->pack[j].len + sizeof(struct chunk);
+        } else if (node->leaf != LEAF_SPAN) {
+            erow *row = &node->u.row[i];
+            used += row->cap + (row->rcap > 0 ? row->rcap : 0) + row->hlcap + row->markcap;
+        }
+    }
+    return used;
+}
+
+void nodeRelease(lnode *node) {
+    for (int i = 0; i < node->n; ++i) {
+        if (!node->leaf) {
+            nodeRelease(node->u.kid[i]);
+        } else if (node->leaf != LEAF_SPAN) {
+            freeRow(&node->u.row[i]);
+        }
+    }
+    spanDrop(node);
+    free(node);
+}
+
+/* Points E, U and J at a new empty buffer; the caller has already
+ * parked or freed whatever they held. */
+void bufferNew() {
+    E.cx = 0;
+    E.cy = 0;
+    E.rx = 0;
+    E.rowoff = 0;
+    E.coloff = 0;
+    E.wrapoff = 0;
+    E.numrows = 0;
+    E.rows = nodeNew(1);
+    E.leaf = NULL;
+    E.leafbase = 0;
+    E.expanded = 0;
+    E.map = NULL;
+    E.mapsize = 0;
+    E.filename = NULL;
+    E.mod = 0;
+    E.changes = 0;
+    E.syntax = NULL;
+    E.hlvalid = 0;
+    U.log = NULL;
+    undoReset();
+    J.fd = -1;
+    J.name = NULL;
+    J.buf = NULL;
+    J.len = J.cap = 0;
+    J.last = -1;
+    J.end = J.mark = 0;
+}
+
+void bufferFree(struct buffer *b) {
+    free(b->filename);
+    b->filename = NULL;
+    if (!b->loaded) return;
+    nodeRelease(b->rows);
+    if (b->map) munmap(b->map, b->mapsize);
+    free(b->undo.log);
+    if (b->journal.fd != -1) close(b->journal.fd);
+    free(b->journal.buf);
+    free(b->journal.name);
+    b->loaded = 0;
+}
+
+/* Moves the current buffer into its slot, folding every clean row back
+ * into the mapping and packing the rest first. */
+void bufferPark() {
+    saveWait();
+    journalFlush();
+    E.trimgen++;
+    if (!E.rows->leaf) nodeTrim(E.rows, 0, 0, 0);
+    struct buffer *b = &L.buf[L.cur];
+    b->cx = E.cx;
+    b->cy = E.cy;
+    b->rowoff = E.rowoff;
+    b->coloff = E.coloff;
+    b->wrapoff = E.wrapoff;
+    b->numrows = E.numrows;
+    b->rows = E.rows;
+    b->map = E.map;
+    b->mapsize = E.mapsize;
+    b->filename = E.filename;
+    b->mod = E.mod;
+    b->changes = E.changes;
+    b->syntax = E.syntax;
+    b->hlvalid = E.hlvalid;
+    b->undo = U;
+    b->journal = J;
+    b->loaded = 1;
+    b->used = nodeUsed(E.rows) + U.cap + J.cap;
+    b->tick = ++L.tick;
+}
+
+void bufferLoad(int idx) {
+    struct buffer *b = &L.buf[idx];
+    L.cur = idx;
+    bufferNew();
+    if (b->loaded) {
+        nodeFree(E.rows);
+        E.numrows = b->numrows;
+        E.rows = b->rows;
+        E.map = b->map;
+        E.mapsize = b->mapsize;
+        E.filename = b->filename;
+        E.mod = b->mod;
+        E.changes = b->changes;
+        E.syntax = b->syntax;
+        E.hlvalid = b->hlvalid;
+        U = b->undo;
+        J = b->journal;
+    } else {
+        fileOpen(b->filename);
+        free(b->filename);
+    }
+    b->filename = NULL;
+    b->loaded = 0;
+    E.cy = b->cy < E.numrows ? b->cy : E.numrows;
+    int size = E.cy < E.numrows ? rowAt(E.cy)->size : 0;
+    E.cx = b->cx < size ? b->cx : (size > 0 ? size - 1 : 0);
+    E.rowoff = b->rowoff;
+    E.coloff = b->coloff;
+    E.wrapoff = b->wrapoff;
+}
+
+/* Unloads clean parked buffers, least recently used first, until the
+ * parked ones fit in the budget. Modified buffers and the one a stream
+ * is read into are never dropped. */
+void bufferEvict() {
+    long used = 0;
+    for (int i = 0; i < L.n; ++i) {
+        if (i != L.cur) used += L.buf[i].used;
+    }
+    while (used > L.budget) {
+        struct buffer *lru = NULL;
+        for (int i = 0; i < L.n; ++i) {
+            struct buffer *b = &L.buf[i];
+            if (i == L.cur || i == P.buf || !b->loaded || b->mod || b->filename == NULL) continue;
+            if (lru == NULL || b->tick < lru->tick) lru = b;
+        }
+        if (lru == NULL) break;
+        used -= lru->used;
+        char *filename = lru->filename;
+        lru->filename = NULL;
+        journalClose(&lru->journal);
+        bufferFree(lru);
+        lru->filename = filename;
+        lru->used = 0;
+        S.unloads++;
+    }
+}
+
+char *bufferName(int idx) {
+    return idx == L.cur ? E.filename : L.buf[idx].filename;
+}
+
+int bufferModified(int idx) {
+    return idx == L.cur ? E.mod : L.buf[idx].mod;
+}
+
+void bufferSwitch(int idx) {
+    if (idx < 0 || idx >= L.n) {
+        setStatusMsg("No buffer %d", idx + 1);
+        return;
+    }
+    if (idx == L.cur) return;
+    bufferPark();
+    bufferLoad(idx);
+    bufferEvict();
+    setStatusMsg("[%d] \"%s\" %dL", idx + 1, E.filename ? E.filename : "[No Name]", E.numrows);
+}
+
+/* Opens filename in a buffer of its own, or switches to the one that
+ * already has it. An empty unnamed buffer is reused. */
+void bufferOpen(char *filename) {
+    for (int i = 0; i < L.n; ++i) {
+        if (bufferName(i) && strcmp(bufferName(i), filename) == 0) {
+            bufferSwitch(i);
+            return;
+        }
+    }
+    if (E.filename == NULL && E.numrows == 0 && !E.mod && P.buf != L.cur) {
+        fileOpen(filename);
+        return;
+    }
+    bufferPark();
+    if (L.n == L.cap) {
+        L.cap *= 2;
+        L.buf = (struct buffer*) realloc(L.buf, sizeof(struct buffer) * L.cap);
+        if (L.buf == NULL) die("realloc");
+    }
+    memset(&L.buf[L.n], 0, sizeof(struct buffer));
+    L.cur = L.n++;
+    bufferNew();
+    fileOpen(filename);
+    bufferEvict();
+}
+
+void bufferList() {
+    char msg[sizeof(E.statusmsg)];
+    size_t len = 0;
+    for (int i = 0; i < L.n && len < sizeof(msg); ++i) {
+        char *name = bufferName(i);
+        len += snprintf(&msg[len], sizeof(msg) - len, "%s%d%s%s %s", i ? " | " : "", i + 1,
+                i == L.cur ? "%" : (L.buf[i].loaded ? "" : "-"), bufferModified(i) ? "+" : "", name ? name : "[No Name]");
+    }
+    setStatusMsg("%s", msg);
+}
+
+/* First buffer other than the current one with unsaved changes, plus
+ * one, or 0. */
+int bufferUnsaved() {
+    for (int i = 0; i < L.n; ++i) {
+        if (i != L.cur && L.buf[i].mod) return i + 1;
+    }
+    return 0;
+}
+
+/* Each row caches its screen line count under soft wrap and the tree
+ * sums them per node, so the screen line of a row and the row at a
+ * screen line are both found in one descent. */
+int rowLines(erow *row) {
+    if (row->vgen == E.wrapgen) return row->vlines;
+    if (row->chars == NULL) {
+        row->vlines = lineLines(E.map + row->off, row->size);
+    } else {
+        renderFlat(row);
+        row->vlines = lineLines(row->render, row->rsize);
+    }
+    row->vgen = E.wrapgen;
+    return row->vlines;
+}
+
+int nodeLines(lnode *node) {
+    if (node->vgen == E.wrapgen) return node->vcount;
+    int v = 0;
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; ++i) v += nodeLines(node->u.kid[i]);
+    } else if (node->leaf == LEAF_SPAN) {
+        char *p = spanText(node);
+        char *end = p + node->u.row[0].size;
+        for (int k = 0; k < node->count; ++k) {
+            int len;
+            char *eol = lineEnd(p, end, &len);
+            v += lineLines(p, len);
+            p = eol + 1;
+        }
+    } else {
+        for (int i = 0; i < node->n; ++i) v += rowLines(&node->u.row[i]);
+    }
+    node->vcount = v;
+    node->vgen = E.wrapgen;
+    return v;
+}
+
+/* Finds screen line v inside a span, walking in from its nearer end. */
+int spanSeek(lnode *span, int base, int v, int *sub) {
+    int len, total = nodeLines(span);
+    char *start = spanText(span);
+    char *end = start + span->u.row[0].size;
+    if (v >= total) return base + span->count;
+    if (v < total / 2) {
+        char *p = start;
+        for (int k = 0; k < span->count - 1; ++k) {
+            char *eol = lineEnd(p, end, &len);
+            int h = lineLines(p, len);
+            if (v < h) {
+                *sub = v;
+                return base + k;
+            }
+            v -= h;
+            p = eol + 1;
+        }
+        *sub = v;
+        return base + span->count - 1;
+    }
+    v = total - 1 - v;
+    char *eol = end;
+    for (int k = span->count - 1; k > 0; --k) {
+        char *bol = (char*) memrchr(start, '\n', eol - start) + 1;
+        lineEnd(bol, eol, &len);
+        int h = lineLines(bol, len);
+        if (v < h) {
+            *sub = h - 1 - v;
+            return base + k;
+        }
+        v -= h;
+        eol = bol - 1;
+    }
+    lineEnd(start, eol, &len);
+    *sub = lineLines(start, len) - 1 - v;
+    return base;
+}
+
+/* Screen lines above row idx. */
+int rowVline(int idx) {
+    if (idx >= E.numrows) return nodeLines(E.rows);
+    rowSlot(idx);
+    lnode *node = E.rows;
+    int v = 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (idx >= node->u.kid[i]->count) {
+            v += nodeLines(node->u.kid[i]);
+            idx -= node->u.kid[i]->count;
+            i++;
+        }
+        node = node->u.kid[i];
+    }
+    for (int j = 0; j < idx; ++j) v += rowLines(&node->u.row[j]);
+    return v;
+}
+
+/* The row holding screen line v, with *sub set to which of its screen
+ * lines that is. Past the end this is E.numrows. */
+int vlineRow(int v, int *sub) {
+    *sub = 0;
+    lnode *node = E.rows;
+    int base = 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->n - 1 && v >= nodeLines(node->u.kid[i])) {
+            v -= nodeLines(node->u.kid[i]);
+            base += node->u.kid[i]->count;
+            i++;
+        }
+        node = node->u.kid[i];
+    }
+    if (node->leaf == LEAF_SPAN) return spanSeek(node, base, v, sub);
+    for (int j = 0; j < node->n; ++j) {
+        int h = rowLines(&node->u.row[j]);
+        if (v < h) {
+            *sub = v;
+            return base + j;
+        }
+        v -= h;
+    }
+    return base + node->n;
+}
+
+/* Which screen line of the row column rx falls on, and its column there. */
+void wrapLocate(erow *row, int rx, int *sub, int *col) {
+    renderFlat(row);
+    int r = 0, c = 0;
+    *sub = 0;
+    while (1) {
+        int w, end = wrapNext(row->render, row->rsize, r, &w);
+        if (end >= row->rsize || rx < c + w) break;
+        c += w;
+        r = end;
+        (*sub)++;
+    }
+    *col = rx - c < E.screencols ? rx - c : E.screencols - 1;
+}
+
+void wrapScroll() {
+    int sub = 0, col = 0;
+    if (E.cy < E.numrows) wrapLocate(rowAt(E.cy), E.rx, &sub, &col);
+    int cv = rowVline(E.cy) + sub;
+    int top = rowVline(E.rowoff) + E.wrapoff;
+    if (cv < top) top = cv;
+    if (cv >= top + E.screenrows) top = cv - E.screenrows + 1;
+    E.rowoff = vlineRow(top, &E.wrapoff);
+    E.wrapcy = cv - top;
+    E.rx = col;
+    E.coloff = 0;
+}
+
+/* Moves the cursor n screen lines, which is how paging goes with soft
+ * wrap on. */
+void wrapMove(long n) {
+    if (E.numrows == 0) return;
+    long v = rowVline(E.cy) + n;
+    if (v < 0) v = 0;
+    int sub;
+    E.cy = vlineRow(v > INT_MAX ? INT_MAX : v, &sub);
+    if (E.cy >= E.numrows) E.cy = E.numrows - 1;
+    clampCursor();
+}
+
+void wrapSet(_Bool on) {
+    E.wrap = on;
+    E.wrapoff = 0;
+    E.coloff = 0;
+    wrapReset();
+}
+
+void scroll() {
+    E.rx = 0;
+    if (E.cy < E.numrows) {
+        E.rx = cxToRx(rowAt(E.cy), E.cx);
+    }
+    if (E.wrap) {
+        wrapScroll();
+        return;
+    }
+
+    if (E.cy < E.rowoff) {
+        E.rowoff = E.cy;
+    }
+    if (E.cy >= E.rowoff + E.screenrows) { 
+        E.rowoff = E.cy - E.screenrows + 1;
+    }
+    if (E.rx < E.coloff) {
+        E.coloff = E.rx;
+    }
+    if (E.rx >= E.coloff + E.screencols) { 
+        E.coloff = E.rx - E.screencols + 1;
+    }
+}
+
+/* Emits len bytes of a row's render from off, in syntax colors. Plain
+ * text is copied around the gap of a shared render instead of closing it
+ * under the cursor on every frame. */
+void drawRender(struct abuf *ab, erow *row, int off, int len) {
+    if (E.syntax == NULL) {
+        int n = len;
+        if (row->rcap < 0 && row->gaplen) {
+            n = off < row->gap ? row->gap - off : 0;
+            if (n > len) n = len;
+        }
+        abAppend(ab, &row->render[off], n);
+        if (n < len) abAppend(ab, &row->chars[off + n + row->gaplen], len - n);
+        return;
+    }
+    renderFlat(row);
+    if (!row->hlfresh) {
+        row->hl = rowGrow(row->hl, &row->hlcap, 0, row->rsize + 1);
+        hlRow(E.syntax, row->render, row->rsize, row->hlin, row->hl);
+        row->hlfresh = 1;
+        S.hlpaints++;
+    }
+    char *s = &row->render[off];
+    char *hl = &row->hl[off];
+    int color = 39;
+    char buf[16];
+    for (int j = 0; j < len;) {
+        int k = j;
+        int c = hlColor(hl[j]);
+        while (k < len && hlColor(hl[k]) == c) k++;
+        if (c != color) {
+            abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%dm", c));
+            color = c;
+        }
+        abAppend(ab, &s[j], k - j);
+        j = k;
+    }
+    if (color != 39) abAppend(ab, "\x1b[39m", 5);
+}
+
+/* Screen lines are drawn in order, so with soft wrap on the row and
+ * render offset carry over from one to the next. */
+void drawWrapped(struct abuf *ab, int y) {
+    static int filerow, off;
+    if (y == 0) {
+        filerow = E.rowoff;
+        off = 0;
+        if (filerow < E.numrows) {
+            erow *row = rowAt(filerow);
+            renderFlat(row);
+            for (int k = 0; k < E.wrapoff && off < row->rsize; ++k) {
+                off = wrapNext(row->render, row->rsize, off, NULL);
+            }
+        }
+    }
+    if (filerow >= E.numrows) {
+        abAppend(ab, "~", 1);
+        return;
+    }
+    erow *row = rowAt(filerow);
+    renderFlat(row);
+    int end = wrapNext(row->render, row->rsize, off, NULL);
+    drawRender(ab, row, off, end - off);
+    if (end >= row->rsize) {
+        filerow++;
+        off = 0;
+    } else {
+        off = end;
+    }
+}
+
+void drawRow(struct abuf *ab, int y) {
+    if (E.wrap) {
+        drawWrapped(ab, y);
+        return;
+    }
+    int filerow = y + E.rowoff;
+    if (filerow >= E.numrows) { 
+        abAppend(ab, "~", 1);
+    } else {
+        erow *row = rowAt(filerow);
+        if (row->rdirty) updateRow(row);
+        int pad, off = colToRender(row, E.coloff, &pad);
+        int cols = pad, len = 0, n;
+        while (off + len < row->rsize) {
+            int w = charCols(renderChar(row, off + len, &n));
+            if (cols + w > E.screencols) break;
+            cols += w;
+            len += n;
+        }
+        abAppend(ab, "  ", pad);
+        drawRender(ab, row, off, len);
+    }
+}
+
+char *fmtBytes(char *buf, size_t len, long n) {
+    if (n < 1024) {
+        snprintf(buf, len, "%ldB", n);
+    } else if (n < 1024L << 10) {
+        snprintf(buf, len, "%.1fK", n / 1024.0);
+    } else if (n < 1024L << 20) {
+        snprintf(buf, len, "%.1fM", n / 1048576.0);
+    } else {
+        snprintf(buf, len, "%.2fG", n / 1073741824.0);
+    }
+    return buf;
+}
+
+/* The right side leads with the memory packing and shared renders save. */
+void drawStatusBar(struct abuf *ab) {
+    abAppend(ab, "\x1b[1;7m", 6);
+    char status[80], rstatus[80], num[32] = "";
+    if (L.n > 1) snprintf(num, sizeof(num), "[%d/%d] ", L.cur + 1, L.n);
+    char *name = E.filename ? E.filename : P.buf == L.cur ? "[stdin]" : "[No Name]";
+    char *state = E.mod ? "| [modified]" : !streamHere() ? "" : P.follow ? "| [following]" : "| [reading]";
+    int len = snprintf(status, sizeof(status), "%s | %s%.20s %s", E.mode == 0 ? "NORMAL" : "INSERT", num, name, state);
+    char saved[24] = "", size[16];
+    long bytes = S.packraw - S.packbytes + S.elided;
+    if (bytes >= 1024) snprintf(saved, sizeof(saved), "%s saved | ", fmtBytes(size, sizeof(size), bytes));
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%d%% | %d:%d", saved, E.numrows != 0 ? 100 * (E.cy + 1) / E.numrows : 0, E.cy + 1, E.cx + 1);
+    if (len > E.screencols) len = E.screencols;
+    abAppend(ab, status, len);
+
+    while (len < E.screencols) {
+        if (E.screencols - len == rlen) {
+            abAppend(ab, rstatus, rlen);
+            break;
+        }
+        abAppend(ab, " ", 1);
+        len++;
+    }
+    abAppend(ab, "\x1b[m", 3);
+}
+
+void drawMsg(struct abuf *ab) {
+    int msglen = strlen(E.statusmsg);
+    if (msglen > E.screencols) msglen = E.screencols;
+    E.msgshown = msglen && time(NULL) - E.statusmsg_time < MSG_TIME;
+    if (E.msgshown) abAppend(ab, E.statusmsg, msglen);
+}
+void setStatusMsg(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+}
+void freeFrame() {
+    for (int i = 0; i < E.framerows; ++i) abFree(&E.frame[i]);
+    free(E.frame);
+    E.frame = NULL;
+    E.framerows = 0;
+}
+
+int resizeFrame(int lines) {
+    if (E.frame && E.framerows == lines && E.framecols == E.screencols) return 0;
+    freeFrame();
+    E.frame = (struct abuf*) calloc(lines, sizeof(struct abuf));
+    if (E.frame == NULL) die("calloc");
+    E.framerows = lines;
+    E.framecols = E.screencols;
+    return 1;
+}
+
+void statsKey() {
+    S.keys++;
+    if (S.waiting) return;
+    clock_gettime(CLOCK_MONOTONIC, &S.keytime);
+    S.waiting = 1;
+}
+
+void statsFrame(double draw, double write, int bytes) {
+    S.frames++;
+    S.drawtime += draw;
+    S.writetime += write;
+    S.bytes += bytes;
+    if (bytes > S.maxbytes) S.maxbytes = bytes;
+    if (!S.waiting) return;
+
+    double lat = elapsed(&S.keytime);
+    double us = lat * 1e6;
+    int b = 0;
+    while (us >= 2 && b < STAT_BUCKETS - 1) {
+        us /= 2;
+        b++;
+    }
+    S.lat[b]++;
+    if (lat > S.latmax) S.latmax = lat;
+    S.waiting = 0;
+}
+
+void updateScreen() {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    scroll();
+    windowSync();
+    hlSync(E.rowoff + E.screenrows - 1);
+
+    int lines = E.screenrows + 2;
+    int full = resizeFrame(lines) || E.repaint;
+    E.repaint = 0;
+
+    struct abuf ab = ABUF_INIT;
+    struct abuf line = ABUF_INIT;
+    char buf[32];
+
+    for (int y = 0; y < lines; ++y) {
+        line.len = 0;
+        if (y < E.screenrows) {
+            drawRow(&line, y);
+        } else if (y == E.screenrows) {
+            drawStatusBar(&line);
+        } else {
+            drawMsg(&line);
+        }
+
+        struct abuf *prev = &E.frame[y];
+        if (!full && prev->len == line.len && (line.len == 0 || memcmp(prev->b, line.b, line.len) == 0)) continue;
+
+        if (ab.len == 0) abAppend(&ab, "\x1b[?25l", 6);
+        snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+        abAppend(&ab, buf, strlen(buf));
+        abAppend(&ab, line.b, line.len);
+        abAppend(&ab, "\x1b[K", 3);
+        S.lines++;
+
+        struct abuf t = *prev;
+        *prev = line;
+        line = t;
+    }
+    abFree(&line);
+
+    int cy = (E.wrap ? E.wrapcy : E.cy - E.rowoff) + 1;
+    int cx = E.rx - E.coloff + 1;
+    if (ab.len || cy != E.framecy || cx != E.framecx) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
+        abAppend(&ab, buf , strlen(buf));
+        E.framecy = cy;
+        E.framecx = cx;
+    }
+    double draw = elapsed(&start);
+    if (ab.len) {
+        abAppend(&ab, "\x1b[?25h", 6);
+        write(E.outfd, ab.b, ab.len);
+    }
+    statsFrame(draw, elapsed(&start) - draw, ab.len);
+    abFree(&ab);
+}
+
+char *commandPrompt(char *prompt, void (*callback)(char *, int)) {
+    size_t bufsize = 128;
+    char *buf = (char*) malloc(bufsize);
+
+    size_t buflen = 0;
+    buf[0] = '\0';
+    
+    while (1) {
+        setStatusMsg(prompt, buf);
+        updateScreen();
+
+        int c = readKeypress();
+        if (c == BACKSPACE || c == CtrlKey('h')) {
+            if (buflen != 0) buf[--buflen] = '\0';
+        } else if (c == '\x1b') {
+            setStatusMsg("");
+            if (callback) callback(buf, c);
+            free(buf);
+            return NULL;
+        } else if (c == '\r') {
+            if (buflen != 0) {
+                setStatusMsg("");
+                if (callback) callback(buf, c);
+                return buf;
+            }
+        } else if(!iscntrl(c) && c < 128) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+        if (callback) callback(buf, c);
+    }
+}
+double statsPercentile(double q) {
+    long total = 0, seen = 0;
+    for (int b = 0; b < STAT_BUCKETS; ++b) total += S.lat[b];
+    for (int b = 0; b < STAT_BUCKETS; ++b) {
+        seen += S.lat[b];
+        if (seen > 0 && seen >= q * total) return (double) (2L << b);
+    }
+    return 0;
+}
+
+char *fmtMicros(char *buf, size_t len, double us) {
+    if (us < 1e3) {
+        snprintf(buf, len, "%.0fus", us);
+    } else if (us < 1e6) {
+        snprintf(buf, len, "%.1fms", us / 1e3);
+    } else {
+        snprintf(buf, len, "%.2fs", us / 1e6);
+    }
+    return buf;
+}
+
+void statsWrite(FILE *fp) {
+    char a[16], b[16];
+    fprintf(fp, "keys %ld, frames %ld\n", S.keys, S.frames);
+    fprintf(fp, "key-to-paint latency:\n");
+    for (int i = 0; i < STAT_BUCKETS; ++i) {
+        if (S.lat[i] == 0) continue;
+        fprintf(fp, "  < %-8s %ld\n", fmtMicros(a, sizeof(a), (double) (2L << i)), S.lat[i]);
+    }
+    fprintf(fp, "  max %s\n", fmtMicros(a, sizeof(a), S.latmax * 1e6));
+    fprintf(fp, "draw %s total, terminal write %s total\n", fmtMicros(a, sizeof(a), S.drawtime * 1e6), fmtMicros(b, sizeof(b), S.writetime * 1e6));
+    fprintf(fp, "bytes written %lld, %.1f per frame, %ld max\n", S.bytes, S.frames ? (double) S.bytes / S.frames : 0.0, S.maxbytes);
+    fprintf(fp, "screen lines repainted %ld, rows re-rendered %ld\n", S.lines, S.rebuilds);
+    fprintf(fp, "highlight state rescans %ld, rows colored %ld\n", S.hlscans, S.hlpaints);
+    fprintf(fp, "row allocations %ld, %ld live large\n", A.allocs, A.large);
+    fprintf(fp, "undo log %ld bytes, budget %ld\n", U.len, U.budget);
+    fprintf(fp, "spans expanded %ld, leaves folded back %ld\n", S.expands, S.collapses);
+    fprintf(fp, "leaves packed %ld, unpacked %ld, %ld bytes held in %ld\n", S.packs, S.unpacks, S.packraw, S.packbytes);
+    fprintf(fp, "render bytes shared with chars %ld\n", S.elided);
+    fprintf(fp, "journal bytes appended %lld, syncs %ld\n", S.jbytes, S.jsyncs);
+    fprintf(fp, "buffers open %d, unloaded under budget %ld\n", L.n, S.unloads);
+    fprintf(fp, "last open %s, last save %s\n", fmtMicros(a, sizeof(a), S.opentime * 1e6), fmtMicros(b, sizeof(b), S.savetime * 1e6));
+}
+
+int statsDump() {
+    if (S.dump[0] == '\0') return 0;
+    FILE *fp = fopen(S.dump, "w");
+    if (fp == NULL) return -1;
+    statsWrite(fp);
+    fclose(fp);
+    return 0;
+}
+
+void statsCommand(char *path) {
+    char p50[16], p99[16], max[16];
+    if (path) {
+        snprintf(S.dump, sizeof(S.dump), "%s", path);
+        if (statsDump() == -1) {
+            setStatusMsg("Couldn't write \"%s\": %s", path, strerror(errno));
+        } else {
+            setStatusMsg("Stats written to \"%s\", again on exit", path);
+        }
+        return;
+    }
+    setStatusMsg("%ld frames | p50 <%s p99 <%s max %s | %.0fB/f | %ld rerender | %ld alloc",
+            S.frames, fmtMicros(p50, sizeof(p50), statsPercentile(0.5)), fmtMicros(p99, sizeof(p99), statsPercentile(0.99)),
+            fmtMicros(max, sizeof(max), S.latmax * 1e6), S.frames ? (double) S.bytes / S.frames : 0.0, S.rebuilds, A.allocs);
+}
+
+/* Each row caches its first match for the current query generation; edits
+ * reset the row's generation so only changed rows are scanned again. */
+int rowFind(int idx, int from) {
+    erow *row = rowSlot(idx);
+    if (row->sgen == E.searchgen && (row->smatch == -1 || row->smatch >= from)) return row->smatch;
+    if (from > row->size) return -1;
+
+    if (findText == NULL) findText = findKernel();
+    int m = findText(rowData(row) + from, row->size - from, E.query, E.querylen);
+    if (m != -1) m += from;
+    if (from == 0) {
+        row->sgen = E.searchgen;
+        row->smatch = m;
+    }
+    return m;
+}
+
+int rowFindBefore(int idx, int before) {
+    int last = -1;
+    int m = rowFind(idx, 0);
+    while (m != -1 && m < before) {
+        last = m;
+        m = rowFind(idx, m + 1);
+    }
+    return last;
+}
+
+/* Searches a span's bytes in one pass, forwards from line k column from,
+ * or backwards for the last match before that point (from == -1 meaning
+ * the end of line k). Returns the column and sets *line, or -1. */
+int spanFind(lnode *span, int k, int from, int dir, int *line) {
+    char *start = spanText(span);
+    char *end = start + span->u.row[0].size;
+    char *p = start;
+    int len;
+    for (int i = 0; i < k; ++i) p = lineEnd(p, end, &len) + 1;
+    char *eol = lineEnd(p, end, &len);
+
+    if (findText == NULL) findText = findKernel();
+    char *hit = NULL;
+    if (from > len) from = len;
+    if (dir > 0) {
+        int m = findText(p + from, end - p - from, E.query, E.querylen);
+        if (m != -1) hit = p + from + m;
+    } else {
+        char *limit = from == -1 ? eol : p + from;
+        char *q = start;
+        int m;
+        while (q < limit && (m = findText(q, end - q, E.query, E.querylen)) != -1 && q + m < limit) {
+            hit = q + m;
+            q = hit + 1;
+        }
+    }
+    if (hit == NULL) return -1;
+    *line = 0;
+    char *bol = start;
+    for (char *nl; (nl = memchr(bol, '\n', hit - bol)) != NULL; bol = nl + 1) (*line)++;
+    return hit - bol;
+}
+
+int searchFrom(int cy, int cx, int dir) {
+    if (E.query == NULL || E.querylen == 0 || E.numrows == 0) return 0;
+    if (cy >= E.numrows) cy = E.numrows - 1;
+    int y = cy;
+    for (int n = 0; n <= E.numrows;) {
+        int m, step = 1;
+        lnode *leaf = leafAt(y);
+        if (leaf->leaf == LEAF_SPAN) {
+            int base = E.leafbase;
+            int line;
+            m = spanFind(leaf, y - base, n == 0 ? cx : (dir > 0 ? 0 : -1), dir, &line);
+            step = dir > 0 ? base + leaf->count - y : y - base + 1;
+            if (m != -1) y = base + line;
+        } else if (dir > 0) {
+            m = rowFind(y, n == 0 ? cx : 0);
+        } else {
+            m = rowFindBefore(y, n == 0 ? cx : rowSlot(y)->size + 1);
+        }
+        if (m != -1) {
+            if (dir > 0 && y < cy) setStatusMsg("search hit BOTTOM, continuing at TOP");
+            if (dir < 0 && y > cy) setStatusMsg("search hit TOP, continuing at BOTTOM");
+            E.cy = y;
+            E.cx = m;
+            return 1;
+        }
+        n += step;
+        y = dir > 0 ? (y + step) % E.numrows : ((y - step) % E.numrows + E.numrows) % E.numrows;
+    }
+    setStatusMsg("Pattern not found: %s", E.query);
+    return 0;
+}
+
+void searchSet(char *query) {
+    if (E.query && strcmp(E.query, query) == 0) return;
+    free(E.query);
+    E.query = strdup(query);
+    E.querylen = strlen(query);
+    if (++E.searchgen == 0) E.searchgen = 1;
+}
+
+void searchCallback(char *query, int key) {
+    static int savedcx, savedcy, active = 0;
+    if (!active) {
+        savedcx = E.cx;
+        savedcy = E.cy;
+        active = 1;
+    }
+    if (key == '\x1b' || key == '\r') {
+        if (key == '\x1b') {
+            E.cx = savedcx;
+            E.cy = savedcy;
+        } else if (E.cx == savedcx && E.cy == savedcy) {
+            searchFrom(savedcy, savedcx + 1, 1);
+        }
+        active = 0;
+        return;
     }
-    free(line);
-    fclose(fp);
+    E.cx = savedcx;
+    E.cy = savedcy;
+    if (query[0] == '\0') return;
+    searchSet(query);
+    searchFrom(savedcy, savedcx + 1, 1);
+}
 
-    E.mod = 0;
+void editorSearch() {
+    char *query = commandPrompt("/%s", searchCallback);
+    free(query);
 }
 
-void scroll() {
-    E.rx = 0;
-    if (E.cy < E.numrows) {
-        E.rx = cxToRx(&E.row[E.cy], E.cx);
+void searchNext(int dir) {
+    if (E.query == NULL) {
+        setStatusMsg("No previous search");
+        return;
     }
+    searchFrom(E.cy, dir > 0 ? E.cx + 1 : E.cx, dir);
+}
 
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
+/* A :s or :g over a range of rows. Workers scan disjoint runs of leaves
+ * and only read the buffer; every change is applied afterwards by the
+ * main thread in row order. */
+struct bulk {
+    char *pat;
+    int patlen;
+    char *rep;
+    int replen;
+    _Bool subst;
+    _Bool all;
+    _Bool invert;
+    int lo;
+    int hi;
+};
+
+typedef struct bulkjob {
+    struct bulk *b;
+    lnode **leaves;
+    int *bases;
+    int nleaves;
+    int *rows;
+    int *ends;
+    int n;
+    int cap;
+    long hits;
+    struct abuf text;
+    int textcap;
+    char *unpacked;
+    int unpackcap;
+} bulkjob;
+
+void bulkPush(bulkjob *job, int idx) {
+    if (job->n == job->cap) {
+        job->cap = job->cap ? job->cap * 2 : 1024;
+        job->rows = realloc(job->rows, sizeof(int) * job->cap);
+        job->ends = realloc(job->ends, sizeof(int) * job->cap);
+        if (job->rows == NULL || job->ends == NULL) die("realloc");
     }
-    if (E.cy >= E.rowoff + E.screenrows) { 
-        E.rowoff = E.cy - E.screenrows + 1;
+    job->rows[job->n] = idx;
+    job->ends[job->n] = job->text.len;
+    job->n++;
+}
+
+/* Substituted text is appended once per piece of every matching line,
+ * so the buffer grows geometrically rather than by exact sizes. */
+void bulkText(bulkjob *job, const char *s, int len) {
+    if (len <= 0) return;
+    if (job->text.len + len > job->textcap) {
+        int cap = job->textcap ? job->textcap : 4096;
+        while (cap < job->text.len + len) cap *= 2;
+        job->text.b = realloc(job->text.b, cap);
+        if (job->text.b == NULL) die("realloc");
+        job->textcap = cap;
     }
-    if (E.rx < E.coloff) {
-        E.coloff = E.rx;
+    memcpy(&job->text.b[job->text.len], s, len);
+    job->text.len += len;
+}
+
+/* Records line idx if it is selected and, for :s, its new text. */
+void bulkLine(bulkjob *job, int idx, const char *p, int len) {
+    struct bulk *b = job->b;
+    if (idx < b->lo || idx >= b->hi) return;
+    int m = findText(p, len, b->pat, b->patlen);
+    if (!b->subst) {
+        if ((m != -1) != b->invert) bulkPush(job, idx);
+        return;
     }
-    if (E.rx >= E.coloff + E.screencols) { 
-        E.coloff = E.rx - E.screencols + 1;
+    if (m == -1) return;
+    int at = 0;
+    while (m != -1) {
+        bulkText(job, &p[at], m);
+        bulkText(job, b->rep, b->replen);
+        at += m + b->patlen;
+        job->hits++;
+        m = b->all ? findText(&p[at], len - at, b->pat, b->patlen) : -1;
     }
+    bulkText(job, &p[at], len - at);
+    bulkPush(job, idx);
 }
 
-void drawRows(struct abuf *ab) {
-    for (int i = 0; i < E.screenrows; ++i) {
-        int filerow = i + E.rowoff;
-        if (filerow >= E.numrows) { 
-            abAppend(ab, "~", 1);
-        } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+/* Spans are searched as one block, so only lines holding a match are
+ * split out; :v has to look at every line. */
+void bulkSpan(bulkjob *job, lnode *span, int base) {
+    struct bulk *b = job->b;
+    char *p = span->pack ? packText(span, &job->unpacked, &job->unpackcap) : E.map + span->u.row[0].off;
+    char *end = p + span->u.row[0].size;
+    int line = base;
+    while (line < b->hi) {
+        if (!b->invert) {
+            int m = findText(p, end - p, b->pat, b->patlen);
+            if (m == -1) return;
+            char *nl;
+            while ((nl = memchr(p, '\n', m)) != NULL) {
+                m -= nl + 1 - p;
+                p = nl + 1;
+                line++;
+            }
         }
-
-        abAppend(ab, "\x1b[K\r\n" , 5);
+        int len;
+        char *eol = lineEnd(p, end, &len);
+        bulkLine(job, line, p, len);
+        if (eol == end) return;
+        p = eol + 1;
+        line++;
     }
 }
 
-void drawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[1;7m", 6);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%s | %.20s %s", E.mode == 0 ? "NORMAL" : "INSERT", E.filename ? E.filename : "[No Name]", E.mod ? "| [modified]" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d%% | %d:%d", E.numrows != 0 ? 100 * (E.cy + 1) / E.numrows : 0, E.cy + 1, E.cx + 1);
-    if (len > E.screencols) len = E.screencols;
-    abAppend(ab, status, len);
+void *bulkThread(void *arg) {
+    bulkjob *job = (bulkjob*) arg;
+    for (int i = 0; i < job->nleaves; ++i) {
+        lnode *leaf = job->leaves[i];
+        if (leaf->leaf == LEAF_SPAN) {
+            bulkSpan(job, leaf, job->bases[i]);
+            continue;
+        }
+        for (int j = 0; j < leaf->n; ++j) {
+            erow *row = &leaf->u.row[j];
+            bulkLine(job, job->bases[i] + j, row->chars ? row->chars : E.map + row->off, row->size);
+        }
+    }
+    return NULL;
+}
 
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
+/* Lists the leaves overlapping rows [lo, hi) with their first row and
+ * flattens the gaps of their rows, so workers can read them directly. */
+int leafCollect(lnode *node, int base, int lo, int hi, lnode **leaves, int *bases, int n) {
+    if (base >= hi || base + node->count <= lo) return n;
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; ++i) {
+            n = leafCollect(node->u.kid[i], base, lo, hi, leaves, bases, n);
+            base += node->u.kid[i]->count;
         }
-        abAppend(ab, " ", 1);
-        len++;
+        return n;
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    if (node->leaf != LEAF_SPAN) {
+        for (int i = 0; i < node->n; ++i) {
+            if (node->u.row[i].chars) rowFlatten(&node->u.row[i]);
+        }
+    }
+    leaves[n] = node;
+    bases[n] = base;
+    return n + 1;
 }
 
-void drawMsg(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
+int leafCount(lnode *node) {
+    if (node->leaf) return 1;
+    int n = 0;
+    for (int i = 0; i < node->n; ++i) n += leafCount(node->u.kid[i]);
+    return n;
+}
 
-    int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols) msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < MSG_TIME) abAppend(ab, E.statusmsg, msglen);
+long leafBytes(lnode *leaf) {
+    long bytes = 0;
+    for (int i = 0; i < leaf->n; ++i) bytes += leaf->u.row[i].size + 1;
+    return bytes;
 }
-void setStatusMsg(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-    va_end(ap);
-    E.statusmsg_time = time(NULL);
+
+/* Swaps in the new text of a line for :s. The render is rebuilt when
+ * the row is next drawn, not here. */
+void rowReplace(erow *row, int idx, const char *s, int len) {
+    undoRecord(UNDO_DELETE, idx, 0, rowData(row), row->size);
+    undoRecord(UNDO_INSERT, idx, 0, s, len);
+    int cap;
+    char *chars = rowAlloc(len + 1, &cap);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    rowRelease(row);
+    row->chars = chars;
+    row->cap = cap;
+    row->wgen = 0;
+    row->size = len;
+    row->gap = 0;
+    row->gaplen = 0;
+    row->rdirty = 1;
+    row->nmarks = 0;
+    row->sgen = 0;
+    row->dirty = 1;
+    row->hlok = 0;
+    row->hlfresh = 0;
+    row->vgen = 0;
+    if (E.wrap) nodeAdjust(E.rows, idx, 0);
 }
-void updateScreen() {
-    scroll();
 
-    struct abuf ab = ABUF_INIT;
+/* Finds the selected rows across threads, then applies every change as
+ * one undo step with a single invalidation. Rows are split out of their
+ * spans in ascending order, which keeps each expansion's walk short,
+ * and deleted from the bottom up so the indices stay valid. */
+void bulkRun(struct bulk *b) {
+    if (findText == NULL) findText = findKernel();
+    if (b->hi > E.numrows) b->hi = E.numrows;
+    if (b->lo >= b->hi) return;
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H" , 3);
-    
-    drawRows(&ab);
-    drawStatusBar(&ab);
-    drawMsg(&ab);
+    int nleaves = leafCount(E.rows);
+    lnode **leaves = (lnode**) malloc(sizeof(lnode*) * nleaves);
+    int *bases = (int*) malloc(sizeof(int) * nleaves);
+    if (leaves == NULL || bases == NULL) die("malloc");
+    nleaves = leafCollect(E.rows, 0, b->lo, b->hi, leaves, bases, 0);
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1, E.rx - E.coloff + 1);
-    abAppend(&ab, buf , strlen(buf));
-    abAppend(&ab, "\x1b[?25h", 6);
+    long total = 0;
+    for (int i = 0; i < nleaves; ++i) total += leafBytes(leaves[i]);
+    int njobs = total / SCAN_CHUNK + 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (njobs > cpus) njobs = cpus > 0 ? cpus : 1;
+    if (njobs > SCAN_THREADS) njobs = SCAN_THREADS;
+    if (njobs > nleaves) njobs = nleaves;
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    bulkjob jobs[SCAN_THREADS];
+    pthread_t threads[SCAN_THREADS];
+    memset(jobs, 0, sizeof(jobs));
+    long seen = 0;
+    for (int i = 0, j = 0; j < njobs; ++j) {
+        jobs[j].b = b;
+        jobs[j].leaves = &leaves[i];
+        jobs[j].bases = &bases[i];
+        while (i < nleaves && (j == njobs - 1 || seen < total / njobs * (j + 1))) {
+            seen += leafBytes(leaves[i++]);
+            jobs[j].nleaves++;
+        }
+    }
+    int started = 1;
+    for (; started < njobs; ++started) {
+        if (pthread_create(&threads[started], NULL, bulkThread, &jobs[started]) != 0) break;
+    }
+    bulkThread(&jobs[0]);
+    for (int i = 1; i < njobs; ++i) {
+        if (i < started) {
+            pthread_join(threads[i], NULL);
+        } else {
+            bulkThread(&jobs[i]);
+        }
+    }
+    free(leaves);
+    free(bases);
+
+    int lines = 0, first = -1, last = -1;
+    long hits = 0;
+    for (int j = 0; j < njobs; ++j) {
+        lines += jobs[j].n;
+        hits += jobs[j].hits;
+        if (jobs[j].n && first == -1) first = jobs[j].rows[0];
+        if (jobs[j].n) last = jobs[j].rows[jobs[j].n - 1];
+    }
+    if (lines == 0) {
+        setStatusMsg("Pattern not found: %s", b->pat);
+    } else if (b->subst) {
+        for (int j = 0; j < njobs; ++j) {
+            for (int k = 0; k < jobs[j].n; ++k) {
+                int start = k ? jobs[j].ends[k - 1] : 0;
+                int idx = jobs[j].rows[k];
+                rowReplace(rowSlot(idx), idx, &jobs[j].text.b[start], jobs[j].ends[k] - start);
+            }
+        }
+        E.cy = last;
+        setStatusMsg("%ld substitution%s on %d line%s", hits, hits == 1 ? "" : "s", lines, lines == 1 ? "" : "s");
+    } else {
+        for (int j = 0; j < njobs; ++j) {
+            for (int k = 0; k < jobs[j].n; ++k) rowSlot(jobs[j].rows[k]);
+        }
+        for (int j = njobs - 1; j >= 0; --j) {
+            for (int k = jobs[j].n - 1; k >= 0; --k) {
+                int idx = jobs[j].rows[k];
+                erow *row = rowSlot(idx);
+                undoRecord(UNDO_DELROW, idx, 0, rowData(row), row->size);
+                freeRow(row);
+                treeDelete(idx);
+            }
+        }
+        E.cy = last - lines + 1;
+        if (E.cy >= E.numrows) E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        setStatusMsg("%d fewer line%s", lines, lines == 1 ? "" : "s");
+    }
+    if (lines) {
+        hlInvalidate(first);
+        E.mod = 1;
+        E.changes++;
+        E.cx = 0;
+        clampCursor();
+    }
+    for (int j = 0; j < njobs; ++j) {
+        free(jobs[j].rows);
+        free(jobs[j].ends);
+        abFree(&jobs[j].text);
+        free(jobs[j].unpacked);
+    }
 }
 
-char *commandPrompt(char *prompt) {
-    size_t bufsize = 128;
-    char *buf = (char*) malloc(bufsize);
+/* Cuts the next field of a :s or :g command at an unescaped delim,
+ * dropping the backslash from \delim. Returns the rest, or NULL if the
+ * field runs to the end. */
+char *bulkField(char *p, char delim, int *len) {
+    char *out = p;
+    char *q = p;
+    while (*q && *q != delim) {
+        if (q[0] == '\\' && q[1] == delim) q++;
+        *out++ = *q++;
+    }
+    *len = out - p;
+    if (*q == '\0') {
+        *out = '\0';
+        return NULL;
+    }
+    *out = '\0';
+    return q + 1;
+}
 
-    size_t buflen = 0;
-    buf[0] = '\0';
-    
-    while (1) {
-        setStatusMsg(prompt, buf);
-        updateScreen();
+/* :s/pat/rep/[g] on the cursor line, :%s/pat/rep/[g] on every line,
+ * :g/pat/d deletes the lines matching pat, and :g!/pat/d or :v/pat/d
+ * the ones that don't. Patterns are literal, as with /. */
+int bulkCommand(char *command) {
+    struct bulk b = {0};
+    b.lo = E.cy;
+    b.hi = E.cy + 1;
+    char *p = command;
+    if (*p == '%') {
+        b.lo = 0;
+        b.hi = E.numrows;
+        p++;
+    }
+    if (*p == 's') {
+        b.subst = 1;
+    } else if (*p == 'g' || *p == 'v') {
+        b.invert = *p == 'v';
+        if (p[1] == '!' && *p == 'g') {
+            b.invert = 1;
+            p++;
+        }
+        b.lo = 0;
+        b.hi = E.numrows;
+    } else {
+        return 0;
+    }
+    p++;
+    char delim = *p;
+    if (delim == '\0' || isalnum((unsigned char) delim) || delim == '\\' || delim == ' ') return 0;
 
-        int c = readKeypress();
-        if (c == BACKSPACE || c == CtrlKey('h')) {
-            if (buflen != 0) buf[--buflen] = '\0';
-        } else if (c == '\x1b') {
-            setStatusMsg("");
-            free(buf);
-            return NULL;
-        } else if (c == '\r') {
-            if (buflen != 0) {
-                setStatusMsg("");
-                return buf;
-            }
-        } else if(!iscntrl(c) && c < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
-            }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
+    b.pat = p + 1;
+    char *rest = bulkField(b.pat, delim, &b.patlen);
+    if (b.patlen == 0) {
+        setStatusMsg("Empty pattern");
+        return 1;
+    }
+    if (b.subst) {
+        b.rep = rest ? rest : "";
+        rest = rest ? bulkField(b.rep, delim, &b.replen) : NULL;
+        if (rest && strcmp(rest, "g") == 0) {
+            b.all = 1;
+        } else if (rest && *rest) {
+            setStatusMsg("Invalid flags: %s", rest);
+            return 1;
         }
+    } else if (rest == NULL || strcmp(rest, "d") != 0) {
+        setStatusMsg("Only :g/pattern/d is supported");
+        return 1;
     }
+    bulkRun(&b);
+    return 1;
 }
+
 void freeEditor() {
     free(E.filename);
     free(E.help);
-    for (int  i = 0; i < E.numrows; ++i) {
-        freeRow(&E.row[i]);
+    free(E.query);
+    free(U.log);
+    free(J.buf);
+    free(J.name);
+    free(K.buf);
+    free(K.raw);
+    free(K.out);
+    free(W.iov);
+    free(W.pieces);
+    free(W.held);
+    rowFree(P.part, P.cap);
+    for (int i = 0; i < L.n; ++i) {
+        if (i != L.cur) bufferFree(&L.buf[i]);
+    }
+    free(L.buf);
+    for (int i = 0; A.large && i < E.numrows; i = E.leafbase + E.leaf->count) {
+        lnode *leaf = leafAt(i);
+        for (int j = 0; j < leaf->n; ++j) freeRow(&leaf->u.row[j]);
     }
-    free(E.row);
+    arenaFree();
+    if (E.rows) nodeFree(E.rows);
+    freeFrame();
+    if (E.map) munmap(E.map, E.mapsize);
 }
 void quitEditor(){ 
-    write(STDOUT_FILENO, "\x1b[2J" , 4);
-    write(STDOUT_FILENO, "\x1b[H" , 3);
+    saveWait();
+    journalClose(&J);
+    for (int i = 0; i < L.n; ++i) {
+        if (i != L.cur && L.buf[i].loaded) journalClose(&L.buf[i].journal);
+    }
+    write(E.outfd, "\x1b[2J" , 4);
+    write(E.outfd, "\x1b[H" , 3);
+    benchReport();
+    statsDump();
     freeEditor();
     exit(0);
 }
 void editorCommand() {
     char *command = NULL;
-    command = commandPrompt(":%s");
+    command = commandPrompt(":%s", NULL);
     if (command == NULL) {
         setStatusMsg("Command Aborted");
         return;
@@ -543,43 +4934,90 @@ void editorCommand() {
         command[commandLen - 1] = '\0';
         commandLen--;
     }
-    if (commandLen > 2 && command[0] != 'o') {
+    if (commandLen > 0 && strspn(command, "0123456789") == (size_t) commandLen) {
+        long n = strtol(command, NULL, 10);
+        gotoLine(n > E.numrows ? E.numrows : (int) n);
+        free(command);
+        return;
+    }
+    if (strcmp(command, "follow") == 0) {
+        streamFollow();
+        free(command);
+        return;
+    }
+    if (strcmp(command, "set wrap") == 0 || strcmp(command, "set nowrap") == 0) {
+        wrapSet(command[4] == 'w');
+        free(command);
+        return;
+    }
+    if (strncmp(command, "stats", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
+        statsCommand(command[5] ? &command[6] : NULL);
+        free(command);
+        return;
+    }
+    if (bulkCommand(command)) {
+        free(command);
+        return;
+    }
+    if (commandLen > 2 && command[0] != 'o' && command[0] != 'e' && command[0] != 'b') {
         setStatusMsg("Invalid Command");
         free(command);
         return;
     }
+    int other = bufferUnsaved();
     switch (command[0]) {
         case 'w':
             fileSave();
             if ((commandLen > 1) && (command[1] == 'q')) {
-                free(command);
-                quitEditor();
+                saveWait();
+                if (E.mod == 0 && other == 0) {
+                    free(command);
+                    quitEditor();
+                } else if (E.mod == 0) {
+                    setStatusMsg("Buffer %d has Unsaved Changes. Type :q! to exit without saving.", other);
+                }
             }
             break;
         case 'q':
-            if (E.mod == 0) {
+            /* A :w just before may still be writing; its result decides E.mod. */
+            saveWait();
+            other = bufferUnsaved();
+            if (E.mod == 0 && other == 0) {
                 free(command);
                 quitEditor();
             } else {
                 if ((commandLen > 1) && (command[1] == '!')) {
                     free(command);
                     quitEditor();
-                } else {
+                } else if (E.mod) {
                     setStatusMsg("You have Unsaved Changes. Type :q! to exit without saving.");
+                } else {
+                    setStatusMsg("Buffer %d has Unsaved Changes. Type :q! to exit without saving.", other);
                 }
             }
             break;
+        case 'e':
         case 'o':
             if (commandLen >= 3 && command[1] == ' ') {
-                if (E.filename == NULL) {
-                    if (E.numrows == 0) {
-                        fileOpen(&command[2]);
-                    } else if (E.numrows > 0){
-                        setStatusMsg("Unsaved Changes detected");
-                    }
-                } else {
-                    setStatusMsg("Already a file is open");
-                }
+                bufferOpen(&command[2]);
+            } else {
+                setStatusMsg("Invalid Command");
+            }
+            break;
+        case 'b':
+            if (strcmp(command, "bn") == 0) {
+                bufferSwitch((L.cur + 1) % L.n);
+            } else if (strcmp(command, "bp") == 0) {
+                bufferSwitch((L.cur + L.n - 1) % L.n);
+            } else if (commandLen >= 3 && command[1] == ' ') {
+                bufferSwitch(atoi(&command[2]) - 1);
+            } else {
+                setStatusMsg("Invalid Command");
+            }
+            break;
+        case 'l':
+            if (strcmp(command, "ls") == 0) {
+                bufferList();
             } else {
                 setStatusMsg("Invalid Command");
             }
@@ -590,23 +5028,33 @@ void editorCommand() {
     }
     free(command);
 }
+void clampCursor() {
+    erow *currRow = (E.cy >= E.numrows) ? NULL : rowAt(E.cy);
+    int currRowLen = currRow ? currRow->size : 0;
+    if (E.cx > currRowLen) {
+        E.cx = currRowLen;
+    }
+    if (currRow) E.cx = charStart(currRow, E.cx);
+    if (E.mode == NORMAL && E.cx > 0 && E.cx == currRowLen) E.cx = charPrev(currRow, E.cx);
+}
+
 void moveCursor(int c) {
-    erow *currRow = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *currRow = (E.cy >= E.numrows) ? NULL : rowAt(E.cy);
 
     switch (c) {
         case ARROW_LEFT:
         case 'h':
             if (E.cx > 0) {
-                E.cx--;
+                E.cx = charPrev(currRow, E.cx);
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = rowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
         case 'l':
             if (currRow && E.cx <= currRow->size - 1) {
-                E.cx++;
+                E.cx = charNext(currRow, E.cx);
             } else if (currRow && E.cx == currRow->size && E.mode == INSERT && E.cy != E.numrows - 1) {
                 E.cy++;
                 E.cx = 0;
@@ -622,16 +5070,60 @@ void moveCursor(int c) {
             if (E.cy < E.numrows - 1) E.cy++;
             break;
     }
-    currRow = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int currRowLen = currRow ? currRow->size : 0;
-    if (E.cx > currRowLen) {
-        E.cx = currRowLen;
+    clampCursor();
+}
+
+/* Counted motions go straight to the target row instead of stepping
+ * through every row in between. */
+void moveRows(int n) {
+    long cy = (long) E.cy + n;
+    if (cy > E.numrows - 1) cy = E.numrows - 1;
+    if (cy < 0) cy = 0;
+    E.cy = cy;
+    clampCursor();
+}
+
+void moveCols(int n) {
+    if (E.cy >= E.numrows) return;
+    long cx = (long) E.cx + n;
+    if (cx > rowAt(E.cy)->size) cx = rowAt(E.cy)->size;
+    if (cx < 0) cx = 0;
+    E.cx = cx;
+    clampCursor();
+}
+
+/* Jumps to the first non-blank of line n, clamped to the buffer, and
+ * centers it if it is off screen. */
+void gotoLine(int n) {
+    if (E.numrows == 0) return;
+    if (n < 1) n = 1;
+    if (n > E.numrows) n = E.numrows;
+    E.cy = n - 1;
+    erow *row = rowAt(E.cy);
+    E.cx = 0;
+    while (E.cx < row->size && isspace((unsigned char) ROWCHAR(row, E.cx))) E.cx++;
+    clampCursor();
+    if (E.cy < E.rowoff || E.cy >= E.rowoff + E.screenrows) {
+        E.rowoff = E.cy - E.screenrows / 2;
+        if (E.rowoff < 0) E.rowoff = 0;
+        E.wrapoff = 0;
     }
-    if (E.mode == NORMAL && E.cx == currRowLen) E.cx--;
 }
 
 void handleKeypress() {
     int c = readKeypress();
+    E.lastkey = c;
+    statsKey();
+    if (E.mode == NORMAL) undoBreak();
+    int count = E.count;
+    int prefix = E.prefix;
+    E.count = 0;
+    E.prefix = 0;
+    if (E.mode == NORMAL && ((c >= '1' && c <= '9') || (c == '0' && count))) {
+        if (prefix) count = 0;
+        E.count = count < 100000000 ? count * 10 + c - '0' : count;
+        return;
+    }
     switch (c) {
         case CtrlKey('q'):
             break;
@@ -639,16 +5131,31 @@ void handleKeypress() {
         case ARROW_DOWN:
         case ARROW_LEFT:
         case ARROW_RIGHT:
-            moveCursor(c);
-            break;
         case 'h':
         case 'j':
         case 'k':
         case 'l':
-            if (E.mode == NORMAL) {
+            if (E.mode == INSERT && c < 128) {
+                insertChar(c);
+            } else if (count == 0) {
                 moveCursor(c);
-            } else if (E.mode == INSERT) {
+            } else if (c == 'j' || c == ARROW_DOWN || c == 'k' || c == ARROW_UP) {
+                moveRows(c == 'j' || c == ARROW_DOWN ? count : -count);
+            } else {
+                moveCols(c == 'l' || c == ARROW_RIGHT ? count : -count);
+            }
+            break;
+        case 'G':
+        case 'g':
+            if (E.mode == INSERT) {
                 insertChar(c);
+            } else if (c == 'G') {
+                gotoLine(count ? count : E.numrows);
+            } else if (prefix == 'g') {
+                gotoLine(count ? count : 1);
+            } else {
+                E.prefix = 'g';
+                E.count = count;
             }
             break;
         case 'i':
@@ -656,7 +5163,7 @@ void handleKeypress() {
             if (E.mode == NORMAL) {
                 E.mode = INSERT;
                 if (E.numrows != 0) {
-                    if ((c == 'a') && (E.cx < E.row[E.cy].size)) {
+                    if ((c == 'a') && (E.cx < rowAt(E.cy)->size)) {
                         moveCursor(ARROW_RIGHT);
                     }
                 }
@@ -674,8 +5181,13 @@ void handleKeypress() {
         case PAGE_UP:
         case PAGE_DOWN:
             {
-                int t = E.screenrows;
-                while(t--) moveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+                long rows = (long) E.screenrows * (count ? count : 1);
+                if (rows > E.numrows && !E.wrap) rows = E.numrows;
+                if (E.wrap) {
+                    wrapMove(c == PAGE_UP ? -rows : rows);
+                } else {
+                    moveRows(c == PAGE_UP ? -rows : rows);
+                }
             }
             break;
         case HOME_KEY:
@@ -684,9 +5196,12 @@ void handleKeypress() {
         case CtrlKey('a'):
             setStatusMsg("%s", E.help);
             break;
+        case CtrlKey('l'):
+            E.repaint = 1;
+            break;
         case END_KEY:
-            if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
-            if (E.mode == NORMAL) E.cx--;
+            if (E.cy < E.numrows) E.cx = rowAt(E.cy)->size;
+            if (E.mode == NORMAL && E.cx > 0) E.cx = charPrev(rowAt(E.cy), E.cx);
             break;
         case '0':
             if (E.mode == NORMAL) {
@@ -697,14 +5212,14 @@ void handleKeypress() {
             break;
         case '$':
             if (E.mode == NORMAL) {
-                if (E.cy < E.numrows) E.cx = E.row[E.cy].size - 1;
+                if (E.cy < E.numrows && rowAt(E.cy)->size > 0) E.cx = charPrev(rowAt(E.cy), rowAt(E.cy)->size);
             } else if (E.mode == INSERT) {
                 insertChar(c);
             }
             break;
 
         case DEL_KEY:
-            if ((E.cx < E.row[E.cx].size || E.cy < E.numrows - 1) && E.mode == INSERT) {
+            if (E.cy < E.numrows && (E.cx < rowAt(E.cy)->size || E.cy < E.numrows - 1) && E.mode == INSERT) {
                 moveCursor(ARROW_RIGHT);
                 delChar();
             } 
@@ -714,9 +5229,15 @@ void handleKeypress() {
             if (E.mode == INSERT) delChar();
             break;
         case 'x':
-            if (E.mode == NORMAL && E.row[E.cy].size > 0) {
-                E.cx++;
-                delChar();
+            if (E.mode == NORMAL && E.cy < E.numrows && rowAt(E.cy)->size > 0) {
+                if (count > 1) {
+                    erow *row = rowAt(E.cy);
+                    rowDelete(row, E.cx, count < row->size - E.cx ? count : row->size - E.cx);
+                    clampCursor();
+                } else {
+                    E.cx = charNext(rowAt(E.cy), E.cx);
+                    delChar();
+                }
             } else if (E.mode == INSERT) {
                 insertChar(c);
             }
@@ -724,22 +5245,48 @@ void handleKeypress() {
         case '\x1b':
             E.mode = NORMAL;
             if (E.numrows > 0) {
-                if (E.cx == E.row[E.cy].size) E.cx--;
+                if (E.cx > 0 && E.cx == rowAt(E.cy)->size) E.cx = charPrev(rowAt(E.cy), E.cx);
             }
             break;
         case '\r':
             if (E.mode == INSERT) insertNewline();
             break;
+        case PASTE_START:
+            pasteText();
+            break;
+        case '/':
+        case 'n':
+        case 'N':
+            if (E.mode == NORMAL) {
+                if (c == '/') {
+                    editorSearch();
+                } else {
+                    searchNext(c == 'n' ? 1 : -1);
+                }
+            } else if (E.mode == INSERT) {
+                insertChar(c);
+            }
+            break;
         case 'o':
             if (E.mode == NORMAL) {
                 E.mode = INSERT;
-                if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+                if (E.cy < E.numrows) E.cx = rowAt(E.cy)->size;
                 insertNewline();
                 E.cx = 0;
             } else if (E.mode == INSERT) {
                 insertChar(c);
             }
             break;
+        case 'u':
+            if (E.mode == NORMAL) {
+                undoApply(0);
+            } else if (E.mode == INSERT) {
+                insertChar(c);
+            }
+            break;
+        case CtrlKey('r'):
+            if (E.mode == NORMAL) undoApply(1);
+            break;
         case 'O':
             if (E.mode == NORMAL) {
                 E.mode = INSERT;
@@ -758,37 +5305,200 @@ void handleKeypress() {
 
 void init() {
     E.mode = NORMAL;
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.coloff = 0;
-    E.numrows = 0;
-    E.row = NULL;
-    E.filename = NULL;
     E.tmpFileExt = ".ded";
-    E.mod = 0;
+    E.journalExt = ".dej";
     E.statusmsg[0] = '\0';
     E.help = (char *) malloc(68);
     snprintf(E.help, 68, "Help | :q  = quit | :w = save | :wq = save and quit | Ctrl-A = help");
     E.statusmsg_time = 0;
+    E.frame = NULL;
+    E.framerows = 0;
+    E.framecols = 0;
+    E.framecy = 0;
+    E.framecx = 0;
+    E.repaint = 0;
+    E.inhead = 0;
+    E.incount = 0;
+    E.ineof = 0;
+    E.msgshown = 0;
+    E.winch = 0;
+    E.lastkey = 0;
+    E.count = 0;
+    E.prefix = 0;
+    E.query = NULL;
+    E.querylen = 0;
+    E.searchgen = 1;
+    U.budget = (long) UNDO_BUDGET << 20;
+    if (getenv("DEDIT_UNDO")) U.budget = atol(getenv("DEDIT_UNDO")) << 20;
+    J.on = getenv("DEDIT_JOURNAL") != NULL;
+    bufferNew();
+    L.buf = (struct buffer*) calloc(1, sizeof(struct buffer));
+    if (L.buf == NULL) die("calloc");
+    L.n = L.cap = 1;
+    L.cur = 0;
+    L.budget = (long) BUFFER_BUDGET << 20;
+    if (getenv("DEDIT_BUFMEM")) L.budget = atol(getenv("DEDIT_BUFMEM")) << 20;
+
+    wakeInit();
 
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    if (B.on) {
+        E.screenrows = BENCH_ROWS;
+        E.screencols = BENCH_COLS;
+    } else if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -= 2;
 }
 
+/* Headless benchmark mode: keys come from a recorded script instead of the
+ * terminal, frames go to /dev/null (or $DEDIT_BENCH_OUT), and every
+ * key-to-paint latency is kept so percentiles can be reported at the end.
+ * A stream gets one read between keys, as if it arrived while idle. */
+int benchOp(int c, int mode) {
+    switch (c) {
+        case '\r':
+            return mode == INSERT ? OP_NEWLINE : OP_OTHER;
+        case BACKSPACE:
+        case CtrlKey('h'):
+        case DEL_KEY:
+            return OP_DELETE;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            return OP_MOVE;
+        case PAGE_UP:
+        case PAGE_DOWN:
+            return OP_PAGE;
+        case PASTE_START:
+            return OP_PASTE;
+        case 'x':
+            return mode == NORMAL ? OP_DELETE : OP_INSERT;
+        case 'h':
+        case 'j':
+        case 'k':
+        case 'l':
+        case '0':
+        case '$':
+            return mode == NORMAL ? OP_MOVE : OP_INSERT;
+        case ':':
+            return mode == NORMAL ? OP_COMMAND : OP_INSERT;
+        case '/':
+        case 'n':
+        case 'N':
+            return mode == NORMAL ? OP_SEARCH : OP_INSERT;
+    }
+    if (mode == INSERT && (c == TAB_KEY || !iscntrl(c))) return OP_INSERT;
+    return OP_OTHER;
+}
+
+void benchRecord(int op, double secs) {
+    if (B.nsamples[op] == B.cap[op]) {
+        B.cap[op] = B.cap[op] ? B.cap[op] * 2 : 1024;
+        B.samples[op] = realloc(B.samples[op], sizeof(double) * B.cap[op]);
+        if (B.samples[op] == NULL) die("realloc");
+    }
+    B.samples[op][B.nsamples[op]++] = secs * 1e6;
+}
+
+int cmpDouble(const void *a, const void *b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+void benchReport() {
+    if (!B.on) return;
+    static const char *names[OP_COUNT] = {
+        "insert", "newline", "delete", "move", "page", "command", "paste", "search", "other"
+    };
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("script   %s\n", B.script);
+    printf("file     %s, %d rows, opened in %.2f ms\n", E.filename ? E.filename : P.buf == L.cur ? "[stdin]" : "[No Name]", E.numrows, S.opentime * 1e3);
+    printf("%-8s %8s %10s %10s %10s %10s\n", "op", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for (int op = 0; op < OP_COUNT; ++op) {
+        int n = B.nsamples[op];
+        if (n == 0) continue;
+        double *v = B.samples[op];
+        qsort(v, n, sizeof(double), cmpDouble);
+        printf("%-8s %8d %10.1f %10.1f %10.1f %10.1f\n", names[op], n, v[(n - 1) / 2], v[(int) ((n - 1) * 0.9)], v[(int) ((n - 1) * 0.99)], v[n - 1]);
+        free(v);
+        B.samples[op] = NULL;
+    }
+    printf("frames   %ld, %lld bytes emitted, %.1f bytes/frame\n", S.frames, S.bytes, S.frames ? (double) S.bytes / S.frames : 0.0);
+    printf("memory   %ld row allocations, %ld live large, peak RSS %ld KB, %ld KB saved\n\n", A.allocs, A.large, ru.ru_maxrss, (S.packraw - S.packbytes + S.elided) >> 10);
+    fflush(stdout);
+    B.on = 0;
+}
+
+void benchRun() {
+    struct timespec start;
+    updateScreen();
+    while (1) {
+        int mode = E.mode;
+        if (streamHere()) streamRead();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        handleKeypress();
+        updateScreen();
+        benchRecord(benchOp(E.lastkey, mode), elapsed(&start));
+    }
+}
+
 int main(int argc, char* argv[]) {
-    enableRawMode();
+    char *filename = NULL;
+    char *record = NULL;
+    int pipefd = -1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            B.on = 1;
+            B.script = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "--follow") == 0) {
+            P.follow = 1;
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    E.infd = STDIN_FILENO;
+    E.outfd = STDOUT_FILENO;
+    E.recordfd = -1;
+    if (getenv("DEDIT_STATS")) snprintf(S.dump, sizeof(S.dump), "%s", getenv("DEDIT_STATS"));
+    if (B.on) {
+        char *out = getenv("DEDIT_BENCH_OUT");
+        E.infd = open(B.script, O_RDONLY);
+        E.outfd = open(out ? out : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (E.infd == -1 || E.outfd == -1) {
+            perror(B.script);
+            return 1;
+        }
+    } else {
+        if (!isatty(STDIN_FILENO)) pipefd = ttyTake();
+        enableRawMode();
+    }
+    if (B.on && filename && strcmp(filename, "-") == 0) pipefd = STDIN_FILENO;
+    if (record) {
+        E.recordfd = open(record, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (E.recordfd == -1) die("open");
+    }
     init();
-    if (argc >= 2){
-        fileOpen(argv[1]);
+    if (filename && strcmp(filename, "-") != 0) {
+        fileOpen(filename);
+        if (pipefd != -1) close(pipefd);
+    } else if (pipefd != -1) {
+        streamOpen(pipefd);
     }
 
-    setStatusMsg("%s", E.help);
+    if (E.statusmsg[0] == '\0') setStatusMsg("%s", E.help);
+    if (B.on) benchRun();
 
+    updateScreen();
     while (1) {
-        updateScreen();
         handleKeypress();
+        if (!inputPending()) updateScreen();
     }
     return 0;
 }